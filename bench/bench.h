@@ -0,0 +1,23 @@
+// Shared harness of the microbenchmarks (tokenize_bench, var_bench,
+// expand_bench, spawn_bench)
+//
+// myShellv6.c is included directly so each benchmark exercises the exact
+// code the shell runs, static functions included; its main() is renamed
+// out of the way. Include this header instead of the shell source.
+#ifndef BENCH_H
+#define BENCH_H
+
+#define main myshell_main
+#include "../myShellv6.c"
+#undef main
+
+#include <time.h>
+
+// Monotonic clock in nanoseconds
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#endif
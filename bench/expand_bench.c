@@ -0,0 +1,62 @@
+// Microbenchmark for the variable expander of myShellv6.c
+//
+// Build:  make bench/expand_bench
+// Run:    bench/expand_bench
+//
+// Expands command lines holding hundreds of references, in every form
+// the expander knows: bare words ($V), embedded (x$V/y), braces (${V}x),
+// defaults (${UNSET:-d}) and special parameters ($?), over 100 variables.
+#include "bench.h"
+
+static const char *const forms[] = {"$V%d", "x$V%d/y", "${V%d}x", "${UNSET%d:-d}", "$?"};
+#define NUM_FORMS (int)(sizeof(forms) / sizeof(forms[0]))
+
+static char *make_line(int refs, int form) {
+    size_t cap = (size_t)refs * 24 + 16;
+    char *line = malloc(cap);
+    size_t len = snprintf(line, cap, "cmd");
+    for (int i = 0; i < refs; i++) {
+        int f = form < 0 ? i % NUM_FORMS : form;
+        line[len++] = ' ';
+        len += snprintf(line + len, cap - len, forms[f], i % 100);
+    }
+    return line;
+}
+
+static void run(int refs, int form) {
+    char *line = make_line(refs, form);
+    int iters = 2000000 / refs;
+    if (iters < 20) iters = 20;
+    int background = 0;
+    double elapsed = 0;
+    size_t bytes = 0;
+
+    for (int i = 0; i < iters; i++) {
+        char **arglist = tokenize(line, &background);
+        double start = now_ns();
+        expand_variables(arglist);
+        elapsed += now_ns() - start;
+        for (int j = 0; arglist[j]; j++) bytes += strlen(arglist[j]);
+        arena_reset(&cmd_arena);
+    }
+
+    printf("%-14s %6d refs: %10.0f ns/line %8.2f ns/ref  (%zu bytes out)\n",
+           form < 0 ? "mixed" : forms[form], refs, elapsed / iters, elapsed / iters / refs, bytes / iters);
+    free(line);
+}
+
+int main(void) {
+    char name[16], value[32];
+    import_environment();
+    for (int i = 0; i < 100; i++) {
+        snprintf(name, sizeof(name), "V%d", i);
+        snprintf(value, sizeof(value), "value-%d", i);
+        set_var(name, value, 0);
+    }
+
+    for (int f = 0; f < NUM_FORMS; f++) run(500, f);
+    run(10, -1);
+    run(500, -1);
+    run(50000, -1);
+    return 0;
+}
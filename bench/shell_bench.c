@@ -0,0 +1,310 @@
+// End-to-end benchmark for the myShellv* binaries
+//
+// Build:  make bench/shell_bench
+// Run:    bench/shell_bench [-n scale] [-m pty|pipe|all] [-w workload] shell...
+//
+// Every shell is started in a scratch directory and fed fixed workloads,
+// either through a pseudo-terminal (one command at a time, waiting for the
+// prompt to come back, which gives per-command latency) or as a block of
+// non-interactive input on stdin (which gives raw throughput). Results are
+// printed as JSON on stdout.
+//
+// Workloads, with -n scale (default 100000):
+//   true      scale x `true`
+//   pipeline  scale/100 x `echo x | cat | cat | cat | cat`
+//   vars      scale/100 x `true $V` after `set V value`
+//   jobs      scale/100 x `true &`
+// Shell versions that lack a feature still run the workload; the numbers
+// then show what that version does with the line.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <poll.h>
+#include <pty.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define CMD_TIMEOUT_MS 10000
+#define RUN_TIMEOUT_S 1800
+#define PROMPT_TAIL 6
+
+typedef struct {
+    const char *name;
+    const char *setup;     // Line run once before timing, or NULL
+    const char *command;
+    int divisor;           // Commands = scale / divisor
+} Workload;
+
+Workload workloads[] = {
+    {"true", NULL, "true", 1},
+    {"pipeline", NULL, "echo x | cat | cat | cat | cat", 100},
+    {"vars", "set V value", "true $V", 100},
+    {"jobs", NULL, "true &", 100},
+};
+#define NUM_WORKLOADS (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+typedef struct {
+    int commands;
+    double seconds;
+    double p50_us, p99_us;   // NAN when not measured
+    long peak_rss_kb;
+    const char *error;
+} Result;
+
+char scratch_dir[] = "/tmp/shell_bench.XXXXXX";
+pid_t running_pid;
+int first_result = 1;
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void on_alarm(int signum) {
+    if (running_pid > 0) kill(running_pid, SIGKILL);
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Wait for the shell, killing it if the whole run takes too long
+static long wait_shell(pid_t pid) {
+    struct rusage ru;
+    int status;
+    running_pid = pid;
+    alarm(RUN_TIMEOUT_S);
+    while (wait4(pid, &status, 0, &ru) < 0) {
+        if (errno != EINTR) return 0;
+    }
+    alarm(0);
+    running_pid = 0;
+    return ru.ru_maxrss;
+}
+
+// Feed the whole workload as one non-interactive input file
+static Result run_pipe(const char *shell, Workload *w, int commands) {
+    Result r = {commands, 0, NAN, NAN, 0, NULL};
+    char input[PATH_MAX];
+    snprintf(input, sizeof(input), "%s/input", scratch_dir);
+    FILE *fp = fopen(input, "w");
+    if (!fp) {
+        r.error = "cannot write input";
+        return r;
+    }
+    if (w->setup) fprintf(fp, "%s\n", w->setup);
+    for (int i = 0; i < commands; i++) fprintf(fp, "%s\n", w->command);
+    fclose(fp);
+
+    double start = now_s();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int in = open(input, O_RDONLY);
+        int out = open("/dev/null", O_WRONLY);
+        if (in < 0 || out < 0 || chdir(scratch_dir) != 0) _exit(126);
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        dup2(out, STDERR_FILENO);
+        execl(shell, shell, (char *)NULL);
+        _exit(127);
+    }
+    if (pid < 0) {
+        r.error = "fork failed";
+        return r;
+    }
+    r.peak_rss_kb = wait_shell(pid);
+    r.seconds = now_s() - start;
+    return r;
+}
+
+// Read from the pty until the output ends with the prompt tail
+static int wait_prompt(int fd, const char *tail, size_t tail_len) {
+    char buf[4096];
+    char last[PROMPT_TAIL] = {0};
+    size_t have = 0;
+    double deadline = now_s() + CMD_TIMEOUT_MS / 1000.0;
+    while (1) {
+        int left = (int)((deadline - now_s()) * 1000);
+        if (left <= 0) return -1;
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, left) <= 0) continue;
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0) return -1;
+        // Keep only the last tail_len bytes seen
+        for (ssize_t i = 0; i < n; i++) {
+            if (have == tail_len) {
+                memmove(last, last + 1, tail_len - 1);
+                have--;
+            }
+            last[have++] = buf[i];
+        }
+        if (have == tail_len && memcmp(last, tail, tail_len) == 0) return 0;
+    }
+}
+
+// Learn the prompt: everything printed before the shell goes quiet
+static size_t read_prompt(int fd, char *tail) {
+    char buf[4096];
+    size_t len = 0;
+    while (1) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, 500) <= 0) break;
+        ssize_t n = read(fd, buf + len, sizeof(buf) - len);
+        if (n <= 0) break;
+        len += n;
+        if (len == sizeof(buf)) len = 0;
+    }
+    size_t tail_len = len < PROMPT_TAIL ? len : PROMPT_TAIL;
+    memcpy(tail, buf + len - tail_len, tail_len);
+    return tail_len;
+}
+
+// Type each command into a pty and time how long the prompt takes to return
+static Result run_pty(const char *shell, Workload *w, int commands) {
+    Result r = {commands, 0, NAN, NAN, 0, NULL};
+    int fd;
+    pid_t pid = forkpty(&fd, NULL, NULL, NULL);
+    if (pid == 0) {
+        if (chdir(scratch_dir) != 0) _exit(126);
+        execl(shell, shell, (char *)NULL);
+        _exit(127);
+    }
+    if (pid < 0) {
+        r.error = "forkpty failed";
+        return r;
+    }
+
+    char tail[PROMPT_TAIL];
+    size_t tail_len = read_prompt(fd, tail);
+    double *lat = malloc(sizeof(double) * commands);
+    char line[256];
+    if (tail_len == 0 || !lat) {
+        r.error = "no prompt";
+    } else if (w->setup) {
+        snprintf(line, sizeof(line), "%s\r", w->setup);
+        if (write(fd, line, strlen(line)) < 0 || wait_prompt(fd, tail, tail_len) != 0) {
+            r.error = "setup timed out";
+        }
+    }
+
+    snprintf(line, sizeof(line), "%s\r", w->command);
+    size_t line_len = strlen(line);
+    double start = now_s();
+    for (int i = 0; i < commands && !r.error; i++) {
+        double t0 = now_s();
+        if (write(fd, line, line_len) < 0 || wait_prompt(fd, tail, tail_len) != 0) {
+            r.error = "command timed out";
+            r.commands = i;
+        }
+        lat[i] = (now_s() - t0) * 1e6;
+    }
+    r.seconds = now_s() - start;
+    if (!r.error) {
+        qsort(lat, commands, sizeof(double), cmp_double);
+        r.p50_us = lat[commands / 2];
+        r.p99_us = lat[(int)(commands * 0.99)];
+    }
+    free(lat);
+
+    if (write(fd, "\004", 1) < 0) kill(pid, SIGKILL);  // Ctrl-D ends every version
+    // Keep draining so the shell never blocks on a full pty while exiting
+    char buf[4096];
+    struct pollfd pfd = {fd, POLLIN, 0};
+    double deadline = now_s() + 2;
+    while (now_s() < deadline && poll(&pfd, 1, 100) >= 0) {
+        if ((pfd.revents & (POLLIN | POLLHUP)) && read(fd, buf, sizeof(buf)) <= 0) break;
+    }
+    kill(pid, SIGKILL);  // Versions that ignore EOF while jobs run
+    r.peak_rss_kb = wait_shell(pid);
+    close(fd);
+    return r;
+}
+
+static void print_number(const char *key, double value, const char *fmt) {
+    printf(", \"%s\": ", key);
+    if (isnan(value)) {
+        printf("null");
+    } else {
+        printf(fmt, value);
+    }
+}
+
+static void print_result(const char *shell, const char *mode, Workload *w, Result *r) {
+    const char *name = strrchr(shell, '/') ? strrchr(shell, '/') + 1 : shell;
+    printf("%s    {\"shell\": \"%s\", \"mode\": \"%s\", \"workload\": \"%s\", \"commands\": %d",
+           first_result ? "" : ",\n", name, mode, w->name, r->commands);
+    first_result = 0;
+    print_number("seconds", r->seconds, "%.6f");
+    print_number("commands_per_sec", r->seconds > 0 ? r->commands / r->seconds : NAN, "%.1f");
+    print_number("p50_us", r->p50_us, "%.1f");
+    print_number("p99_us", r->p99_us, "%.1f");
+    printf(", \"peak_rss_kb\": %ld", r->peak_rss_kb);
+    if (r->error) printf(", \"error\": \"%s\"", r->error);
+    printf("}");
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    int scale = 100000;
+    const char *mode = "all";
+    const char *only = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:m:w:")) != -1) {
+        switch (opt) {
+        case 'n': scale = atoi(optarg); break;
+        case 'm': mode = optarg; break;
+        case 'w': only = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-n scale] [-m pty|pipe|all] [-w workload] shell...\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind == argc || scale < 1) {
+        fprintf(stderr, "Usage: %s [-n scale] [-m pty|pipe|all] [-w workload] shell...\n", argv[0]);
+        return 2;
+    }
+    if (!mkdtemp(scratch_dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    signal(SIGALRM, on_alarm);
+
+    printf("{\n  \"scale\": %d,\n  \"results\": [\n", scale);
+    for (int s = optind; s < argc; s++) {
+        char shell[PATH_MAX];
+        if (!realpath(argv[s], shell)) {
+            perror(argv[s]);
+            continue;
+        }
+        for (int i = 0; i < NUM_WORKLOADS; i++) {
+            Workload *w = &workloads[i];
+            if (only && strcmp(only, w->name) != 0) continue;
+            int commands = scale / w->divisor > 0 ? scale / w->divisor : 1;
+            if (strcmp(mode, "pty") != 0) {
+                Result r = run_pipe(shell, w, commands);
+                print_result(shell, "pipe", w, &r);
+            }
+            if (strcmp(mode, "pipe") != 0) {
+                Result r = run_pty(shell, w, commands);
+                print_result(shell, "pty", w, &r);
+            }
+        }
+    }
+    printf("\n  ]\n}\n");
+
+    char cmd[PATH_MAX + 16];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", scratch_dir);
+    if (system(cmd) != 0) fprintf(stderr, "could not remove %s\n", scratch_dir);
+    return 0;
+}
@@ -0,0 +1,66 @@
+// Spawn benchmark for the execute() backends of myShellv6.c
+//
+// Build:  make bench/spawn_bench
+// Run:    bench/spawn_bench [spawns-per-run]
+//
+// For each shell RSS (grown with a touched ballast allocation) and each
+// spawn backend, /bin/true is started repeatedly. Reports spawns/second
+// for the full spawn+wait cycle and p50/p99 of the time the shell is
+// blocked inside the spawn call itself.
+#include "bench.h"
+
+static long rss_kb(void) {
+    long pages = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp) {
+        if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) resident = 0;
+        fclose(fp);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+    int spawns = argc > 1 ? atoi(argv[1]) : 2000;
+    size_t ballast_mb[] = {0, 64, 256, 1024};
+    char *args[] = {"true", NULL};
+    SpawnRequest req = {hash_command("true"), args, {-1, -1, -1}, -1, 0, 0, -1};
+    double *lat = malloc(sizeof(double) * spawns);
+    char *ballast = NULL;
+    size_t have = 0;
+
+    printf("%-12s %10s %12s %10s %10s\n", "backend", "rss_kb", "spawns/s", "p50_us", "p99_us");
+    for (size_t b = 0; b < sizeof(ballast_mb) / sizeof(ballast_mb[0]); b++) {
+        size_t want = ballast_mb[b] << 20;
+        if (want > have) {
+            ballast = realloc(ballast, want);
+            if (!ballast) {
+                perror("realloc");
+                return 1;
+            }
+            memset(ballast + have, 1, want - have);  // Fault the pages in
+            have = want;
+        }
+        for (int mode = 0; spawn_modes[mode] != NULL; mode++) {
+            double start = now_ns();
+            for (int i = 0; i < spawns; i++) {
+                double t0 = now_ns();
+                pid_t pid = spawn_backends[mode].spawn(&req);
+                lat[i] = now_ns() - t0;
+                if (pid > 0) waitpid(pid, NULL, 0);
+            }
+            double elapsed = now_ns() - start;
+            qsort(lat, spawns, sizeof(double), cmp_double);
+            printf("%-12s %10ld %12.0f %10.1f %10.1f\n", spawn_backends[mode].name, rss_kb(),
+                   spawns / (elapsed / 1e9), lat[spawns / 2] / 1e3,
+                   lat[(int)(spawns * 0.99)] / 1e3);
+        }
+    }
+    free(ballast);
+    free(lat);
+    return 0;
+}
@@ -0,0 +1,57 @@
+// Microbenchmark for the arena-backed tokenize() of myShellv6.c
+//
+// Build:  make bench/tokenize_bench
+// Run:    bench/tokenize_bench
+//
+// Splits lines of 10, 1000 and 100000 words and reports the time per line
+// and per word, and how often the arena calls malloc() for the first
+// command compared with later ones, which reuse its chunks.
+#include "bench.h"
+
+static char *make_line(int nargs) {
+    size_t cap = (size_t)nargs * 12 + 16;
+    char *line = malloc(cap);
+    size_t len = snprintf(line, cap, "cmd");
+    for (int i = 1; i < nargs; i++) {
+        len += snprintf(line + len, cap - len, " arg%d", i);
+    }
+    return line;
+}
+
+static void run(int nargs) {
+    char *line = make_line(nargs);
+    int iters = 2000000 / nargs;
+    if (iters < 20) iters = 20;
+
+    // The first command pays for growing the arena; later ones reuse it
+    int background = 0;
+    size_t before = cmd_arena.allocs;
+    char **arglist = tokenize(line, &background);
+    size_t first_allocs = cmd_arena.allocs - before;
+    int count = 0;
+    while (arglist && arglist[count]) count++;
+    arena_reset(&cmd_arena);
+
+    before = cmd_arena.allocs;
+    double start = now_ns();
+    for (int i = 0; i < iters; i++) {
+        background = 0;
+        tokenize(line, &background);
+        arena_reset(&cmd_arena);
+    }
+    double elapsed = now_ns() - start;
+    size_t steady_allocs = cmd_arena.allocs - before;
+
+    printf("%8d args (%d parsed): %12.0f ns/line  %8.2f ns/arg  "
+           "allocs first=%zu steady=%.2f/cmd\n",
+           nargs, count, elapsed / iters, elapsed / iters / nargs,
+           first_allocs, (double)steady_allocs / iters);
+    free(line);
+}
+
+int main(void) {
+    run(10);
+    run(1000);
+    run(100000);
+    return 0;
+}
@@ -0,0 +1,52 @@
+// Benchmark for the variable table of myShellv6.c
+//
+// Build:  make bench/var_bench
+// Run:    bench/var_bench [variables]
+//
+// Times set, overwrite, get, miss and unset of N (default 10000)
+// variables on top of the imported environment.
+#include "bench.h"
+
+static void report(const char *what, double start, int n) {
+    printf("%-10s %8d ops %10.1f ns/op\n", what, n, (now_ns() - start) / n);
+}
+
+int main(int argc, char *argv[]) {
+    int n = argc > 1 ? atoi(argv[1]) : 10000;
+    char (*names)[32] = malloc(sizeof(*names) * n);
+    char value[32];
+    double start;
+    long found = 0;
+
+    import_environment();
+    for (int i = 0; i < n; i++) snprintf(names[i], sizeof(names[i]), "VAR_%d", i);
+
+    start = now_ns();
+    for (int i = 0; i < n; i++) {
+        snprintf(value, sizeof(value), "%d", i);
+        set_var(names[i], value, 0);
+    }
+    report("set", start, n);
+
+    start = now_ns();
+    for (int i = 0; i < n; i++) set_var(names[i], "overwritten", 0);
+    report("overwrite", start, n);
+
+    start = now_ns();
+    for (int round = 0; round < 10; round++) {
+        for (int i = 0; i < n; i++) found += get_var(names[i]) != NULL;
+    }
+    report("get", start, n * 10);
+
+    start = now_ns();
+    for (int i = 0; i < n; i++) found += get_var("NOT_A_VARIABLE") != NULL;
+    report("miss", start, n);
+
+    start = now_ns();
+    for (int i = 0; i < n; i++) found += remove_var(names[i]);
+    report("unset", start, n);
+
+    printf("table: %zu variables in %zu slots (checksum %ld)\n", var_count, var_cap, found);
+    free(names);
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -5,496 +6,5305 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <string.h>
+#include <ctype.h>
 #include <signal.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include <errno.h>
 #include <limits.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <spawn.h>
+#include <sys/file.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <stdarg.h>
 
-#define MAXARGS 10
-#define ARGLEN 30
 #define PROMPT "MyShell"
 #define HISTORY_FILE ".my_shell_history"
-#define MAX_JOBS 100
-#define MAX_VARS 100
+#define JOB_TABLE_MIN 16
+#define VAR_TABLE_MIN 64
+#define ARENA_CHUNK 4096
+#define ARENA_ALIGN 16
+#define CMD_HASH_SIZE 256
+#define CLONE_STACK_SIZE (64 * 1024)
+#define BATCH_BUFSIZE (64 * 1024)
+#define HISTORY_KEEP 10000   // Entries kept when the history log is compacted
+#define HISTORY_WINDOW 1000  // Entries given to readline at startup and per step back
+#define HISTORY_SEARCH_MAX 20       // Results listed by `history search`
+#define HISTORY_SEARCH_SCAN 100000  // Matches looked at when ranking them
+#define TRIGRAM_TABLE_MIN 4096
+#define PARSE_CACHE_BUCKETS 256
+#define TRACE_ENV "MYSHELL_TRACE"   // Trace output file; tracing is off when unset
+#define TRACE_EVENTS 65536          // Ring buffer size, the oldest events are dropped
+#define COPROC_MAX 16
+#define CGROUP_CPU_PERIOD 100000  // cpu.max period in microseconds
+#define HEREDOC_MAX 16       // Here-documents waiting for their bodies at once
+#define HERE_PIPE_MAX PIPE_BUF  // Larger bodies go into a memfd instead of a pipe
+#define LINK_SAMPLE_MS 100   // pipe_stats: how often a link with data queued is looked at
+#define PROMPT_SEGMENT_MAX 64
+#define PROMPT_RECHECK_MS 10000  // An empty slow segment waits this long to be redone in one directory
+#define PROMPT_MAX (PATH_MAX + 50 + 3 * (PROMPT_SEGMENT_MAX + 3))
 
+// Slot of the open-addressing variable table; name == NULL means empty
 typedef struct {
-    char *str;     // name=value string
-    int global;    // Boolean: 1 if global (environment), 0 if local
+    const char *name;    // Not NUL-terminated when borrowed from environ
+    const char *value;
+    unsigned hash;
+    unsigned name_len;
+    int flags;
 } Var;
 
+#define VAR_GLOBAL   1   // Exported to the environment
+#define VAR_BORROWED 2   // name/value point into environ, not owned
+#define VAR_SHELL    4   // Set in this shell (not just imported), shown by list
+
+// Slot of the job table. Free slots are chained through next; live slots
+// form a doubly linked list in launch order.
 typedef struct {
-    pid_t pid;
+    pid_t pid;         // Last process of the pipeline, 0 when the slot is free
+    pid_t pgid;        // Process group of the whole pipeline
+    int nprocs;        // Processes not reaped yet
+    int status;        // Wait status of the last process
+    int prev, next;    // Slot indices, -1 at either end
+    int cgroup_id;     // Its job<N> group under `shopt cgroup`, 0 for none
     char command[256];
+    char limits[128];  // What it was started with, shown by `jobs`
 } Job;
 
-Job jobs[MAX_JOBS];
-Var vars[MAX_VARS];   // Array to store variables
-int job_count = 0;
-int var_count = 0;
+// Long-lived child started by `coproc`, talking to the shell through two
+// pipes. The shell's ends are published as NAME_IN and NAME_OUT, which
+// hold /dev/fd/N paths, so any redirection can use them.
+typedef struct {
+    char name[64];       // Empty when the slot is free
+    pid_t pid;           // 0 once it has exited
+    int in_fd;           // Write end of its stdin, -1 once closed
+    int out_fd;          // Read end of its stdout, kept until the slot is reused
+} Coproc;
+
+// Body of a `<<` here-document, read from the lines after the command
+typedef struct {
+    char *delim;         // Line that ends the body
+    char *body;          // Lines read so far, each with its newline
+    size_t len, cap;
+    int strip_tabs;      // `<<-`: leading tabs are removed from each line
+    int literal;         // Quoted delimiter: no variable expansion
+} HereDoc;
+
+// Entry of the pid -> job index; pid 0 marks an empty entry
+typedef struct {
+    pid_t pid;
+    int slot;
+} JobPid;
+
+// Posting list of one trigram of the history search index. Entries are
+// indexed as "\1\1" + line, so the first trigrams also anchor prefixes.
+typedef struct {
+    unsigned key;       // Three bytes; 0 marks an empty slot
+    unsigned count, cap;
+    unsigned *ids;      // Entry numbers, ascending
+} Trigram;
+
+// A distinct line found by `history search`
+typedef struct {
+    const char *line;
+    size_t len;
+    unsigned hash;
+    long newest;        // Number of its most recent occurrence
+    int count;          // Occurrences
+    int prefix;         // Starts with the query
+} SearchHit;
+
+// Bump allocator for everything that lives only as long as one command line
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk *head;   // Current (and largest) chunk
+    ArenaChunk *spare;  // Chunk kept by arena_release() for the next growth
+    size_t allocs;      // Number of malloc() calls made, for benchmarking
+} Arena;
+
+// Point an arena can be rolled back to, for memory used by one loop iteration
+typedef struct {
+    ArenaChunk *chunk;
+    size_t used;
+} ArenaMark;
+
+// Remembered location of an external command (the `hash` table)
+typedef struct CmdHash {
+    char *name;
+    char *path;
+    dev_t dev;               // Identity of the file when it was found,
+    ino_t ino;               // used to notice it was replaced or removed
+    struct timespec mtime;
+    unsigned hits;
+    struct CmdHash *next;
+} CmdHash;
+
+// Everything a spawn backend needs to start one child process
+typedef struct {
+    const char *path;   // Resolved executable, or NULL to search PATH
+    char **argv;
+    int fds[3];         // New stdin/stdout/stderr (all O_CLOEXEC), -1 to inherit
+    pid_t pgid;         // Process group to join, 0 for a new one, -1 for the shell's
+    int nice;           // Added to the niceness, 0 to keep it
+    int ioprio;         // ioprio_set() value, 0 to keep the I/O priority
+    int cgroup_fd;      // cgroup.procs of its job group, -1 for the shell's group
+} SpawnRequest;
+
+// I/O scheduling classes of ioprio_set(), which glibc does not wrap
+enum { IOPRIO_CLASS_NONE, IOPRIO_CLASS_RT, IOPRIO_CLASS_BE, IOPRIO_CLASS_IDLE };
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+// Resource limit that `ulimit` sets for the commands the shell starts
+typedef struct {
+    char option;         // ulimit -<option>
+    int resource;        // RLIMIT_*
+    rlim_t unit;         // Bytes per unit shown, 1 for counts and seconds
+    const char *name;    // Short name, as shown by `jobs`
+    const char *help;
+} UlimitResource;
+
+// A way of starting a child process with its stdio redirected
+typedef struct {
+    const char *name;
+    pid_t (*spawn)(SpawnRequest *req);
+} SpawnBackend;
+
+// Entry of the built-in command registry
+typedef struct {
+    const char *name;
+    int (*handler)(char *arglist[]);
+    int flags;
+    const char *usage;
+    const char *help;
+} Builtin;
+
+#define BUILTIN_PIPELINE 1   // Only produces output, so it can be a pipeline stage
+#define BUILTIN_FORK     2   // Has to run in a child process to be a pipeline stage
+
+// One command of a pipeline with its own redirections
+typedef struct {
+    char **argv;
+    const char *in_file, *out_file, *err_file;   // NULL if not redirected
+    const char *here;    // Here-document or here-string fed to stdin, or NULL
+    int here_literal;    // A here-document with a quoted delimiter
+    pid_t pid;           // 0 if it could not be started
+    int in_shell;        // A built-in the shell ran itself; status is still set
+    int status;          // Wait status once reaped
+    struct timespec start, end;
+    struct rusage usage; // Resources used, from wait4()
+} Stage;
+
+typedef struct {
+    Stage *stages;
+    int nstages;
+    int background;
+    int timed;           // TIME_* report printed after a foreground run
+    const char *text;    // Command line, for the job table
+    Builtin *builtin;    // Stage 0's built-in, when its name is a literal word
+    int name_expands;    // Stage 0's name contains `$`: look it up after expansion
+    int nice;            // `nice` prefix: niceness added in each child, 0 if none
+    int ioprio;          // `ionice` prefix: I/O priority of each child, 0 if none
+    int cgroup_id;       // Job group it was placed in, 0 if none
+} Pipeline;
+
+// Pipe between two stages that the shell relays with splice() under
+// `shopt pipe_stats on`, timing how long it sits full or empty
+enum { LINK_FLOWING, LINK_FULL, LINK_EMPTY };
+
+typedef struct {
+    int from, to;        // Shell's ends: stage i writes into from, stage i+1 reads to; -1 once closed
+    int state;           // LINK_* at the last sample
+    unsigned long long bytes;
+    long long full_ns;   // Stage i+1 had not drained it, so stage i waited
+    long long empty_ns;  // Nothing queued, so stage i+1 waited for stage i
+    long long open_ns;   // Time until the link closed
+} PipeLink;
+
+// Command of a compound command list. Everything is parsed once into the
+// command arena; simple commands are copied before each run because
+// expansion rewrites their argv arrays.
+enum { NODE_COMMAND, NODE_FOR, NODE_WHILE, NODE_IF };
+
+typedef struct Node {
+    int type;
+    struct Node *next;       // Next command of the list
+    Pipeline *pl;            // NODE_COMMAND, unexpanded
+    const char *text;        // NODE_COMMAND: its words, for jobs and `time`
+    const char *var;         // NODE_FOR: loop variable
+    char **words;            // NODE_FOR: values, unexpanded
+    struct Node *cond;       // NODE_WHILE, NODE_IF
+    struct Node *body;       // Loop body, or `then` branch
+    struct Node *orelse;     // NODE_IF: `else` branch; an `elif` is a nested NODE_IF
+} Node;
+
+// Recursive-descent parser over the words of a compound command
+typedef struct {
+    char **tok;
+    int pos;
+    int error;           // PARSE_*
+} Parser;
+
+enum { PARSE_OK, PARSE_ERROR, PARSE_MORE };
+
+// Arguments of a `test` expression being evaluated
+typedef struct {
+    char **arg;
+    int pos, argc;
+    int error;           // Set on a malformed expression: exit status 2
+} TestExpr;
+
+// Parsed form of a command line, kept by the parse cache. Words are
+// stored unexpanded, so an entry stays valid whatever variables hold.
+typedef struct ParseEntry {
+    struct ParseEntry *chain;        // Next entry in the hash bucket
+    struct ParseEntry *prev, *next;  // LRU list, most recently used first
+    unsigned hash;
+    size_t text_len;
+    char *text;
+    int nstages, background, timed, name_expands, nice, ioprio;
+    Builtin *builtin;
+    size_t words_size;
+    char *words;         // Every word, NUL-terminated, back to back
+    int *layout;         // Per stage: argc, in, out, err, here, argv... as offsets into words, -1 if none
+} ParseEntry;
+
+enum { TIME_OFF, TIME_TEXT, TIME_JSON };
+
+// One complete ("ph": "X") event of the Chrome trace
+typedef struct {
+    const char *name;   // Static string
+    long long start;    // CLOCK_MONOTONIC nanoseconds
+    long long dur;
+    pid_t tid;          // Child pid for process lifetimes, else the shell
+} TraceEvent;
+
+// Shell option settable with `shopt`; either one of choices or a number
+typedef struct {
+    const char *name;
+    const char *const *choices;   // NULL-terminated, or NULL for numeric options
+    int *value;
+    const char *help;
+} ShellOption;
+
+// Part of the prompt's first line, shown as -(value). Fast segments are
+// computed by the shell before each prompt; slow ones by the prompt worker,
+// which writes "index<TAB>value" lines as it goes. "index~value" is a first
+// guess, only shown while nothing is known for that directory.
+typedef struct PromptSegment {
+    const char *name;
+    int *option;                                // Shown while this is non-zero
+    void (*fast)(struct PromptSegment *seg);
+    void (*slow)(int index, int fd);
+    int per_dir;                                // Only valid in the directory it came from
+    char value[PROMPT_SEGMENT_MAX];
+    char dir[PATH_MAX];
+    struct timespec updated;
+} PromptSegment;
+
+extern char **environ;
+
+Job *jobs;            // Job table; job ID n lives in slot n - 1
+int job_cap = 0;
+int job_free = -1;    // Head of the free slot list
+int job_head = -1, job_tail = -1;  // Live jobs, oldest first
+JobPid *job_pids;     // Hash index of every job process, job_pids_cap entries
+size_t job_pids_cap = 0, job_pids_count = 0;
+Var *vars;            // Variable hash table, var_cap slots (a power of two)
+size_t var_cap = 0;
+int job_count = 0;    // Number of live jobs
+size_t var_count = 0;
+Arena cmd_arena;      // Per-command arena, reset after every command line
+CmdHash *cmd_hash[CMD_HASH_SIZE];  // Command name -> absolute path
+int last_status = 0;  // Exit status of the most recent command
+pid_t last_background_pid = 0;  // $!
+pid_t shell_pid = 0;  // $$, looked up on first use
+char *pipe_status_text, *pipe_times_text;  // PIPESTATUS and PIPETIMES, NULL until a pipeline ran
+size_t pipe_text_cap = 0;
+int interactive = 0;  // Reading commands from a terminal through readline
+int sigchld_fd = -1;  // signalfd for SIGCHLD; children are reaped from the main loop
+sigset_t orig_sigmask;  // Signal mask restored in child processes
+char prompt[PROMPT_MAX];
+int prompt_active = 0;  // readline callback handler is installed
+int prompt_header_len;  // Width of the prompt line above the input, as drawn
+char shell_cwd[PATH_MAX];  // Working directory, refreshed by `cd` only
+long last_command_ms;   // Wall time of the last command line
+int event_ep = -1;      // epoll set of the interactive event loop
+
+// Prompt worker: a forked process computing the slow segments. The prompt
+// shows the last known values until it reports, and it is killed once
+// prompt_timeout_ms have passed.
+pid_t prompt_worker;    // Until reaped
+int prompt_worker_fd = -1;
+char prompt_worker_buf[256];
+size_t prompt_worker_len;
+char prompt_worker_dir[PATH_MAX];
+struct timespec prompt_worker_since;
+int shell_done = 0;   // EOF seen on the terminal
+
+// Append-only history log: entries are buffered here and written with a
+// single O_APPEND write() per flush
+char history_path[PATH_MAX + sizeof(HISTORY_FILE) + 1];
+int history_fd = -1;
+char *history_pending;
+size_t history_pending_len, history_pending_cap;
+int history_pending_count;
+struct timespec history_pending_since;
+long history_entries;   // Entries in the log file, to decide on compaction
+
+// The log as it was at startup, mapped read-only. Only the newest entries
+// are copied into readline; older ones stay in the map until recalled.
+const char *history_map;
+size_t history_map_len;
+size_t history_loaded_start;  // Map offset of the oldest entry readline has
+size_t *history_offsets;      // Entry starts before that, once indexed
+long history_older = -1;      // Entries before history_loaded_start, -1 if not counted
+
+// Trigram index for history search, built on first use and then kept up
+// to date as entries are added
+Trigram *trigrams;
+size_t trigram_cap, trigram_count;
+
+// Command names on PATH for completion, sorted. Built by the first
+// completion and dropped as soon as inotify reports a change in one of
+// the directories or PATH is changed.
+char **path_commands;
+size_t path_command_count;
+char *path_command_names;     // Storage the entries point into
+int path_index_valid = 0;
+int path_inotify_fd = -1;
+
+// Parse cache: command text -> ParseEntry, with an LRU bound
+ParseEntry *parse_cache[PARSE_CACHE_BUCKETS];
+ParseEntry *parse_lru_head, *parse_lru_tail;
+int parse_cache_count;
+int parse_cache_max = 256;   // `shopt parse_cache`; 0 turns caching off
+unsigned long parse_hits, parse_misses, parse_evictions;
+
+Coproc coprocs[COPROC_MAX];
+
+// Lines of a compound command still waiting for its `done`/`fi`
+char *compound_buf;
+size_t compound_len, compound_cap;
+
+// Here-documents of the command waiting in heredoc_line. Bodies are
+// handed to the parser in the order their `<<` appears.
+HereDoc heredocs[HEREDOC_MAX];
+int heredoc_count;   // Here-documents opened
+int heredoc_filled;  // Bodies complete; heredoc_count when none is pending
+int heredoc_used;    // Bodies taken by the current parse
+char *heredoc_line;  // Line that opened them
+volatile sig_atomic_t interrupted;   // Ctrl-C: stop running loops
+
+// Scratch buffer a word is expanded into before it is copied to the arena
+char *expand_buf;
+size_t expand_len, expand_cap;
+
+// Tracing of the shell's own stages. The ring is written only from the
+// main thread, so it needs no locking; with tracing off every probe is a
+// single test of trace_events.
+TraceEvent *trace_events;       // NULL when tracing is off
+unsigned long trace_count;      // Events recorded since the last dump
+const char *trace_path;
+long long trace_read_start;     // When the prompt was shown
+
+#define TRACE_BEGIN() (trace_events ? trace_clock() : 0)
+#define TRACE_END(name, start) do { if (start) trace_record(name, start, 0, 0); } while (0)
 
 // Function prototypes
-int execute(char *arglist[], int input_fd, int output_fd, int error_fd, int background);
+pid_t execute(Pipeline *pl, Stage *stage, int fds[3], pid_t pgid, int cgroup_fd);
+static void child_limits(SpawnRequest *req);
 int handle_builtin(char *arglist[]);
+Builtin *find_builtin(const char *name);
 char **tokenize(char *cmdline, int *background);
-void handle_pipes_and_execute(char **arglist, int background);
-void sigchld_handler(int signum);
+static size_t here_op_len(const char *word, size_t len);
+Pipeline *parse_line(const char *cmdline, int *error);
+void run_compound(const char *cmdline);
+void run_list(Node *node);
+int compound_pending();
+Pipeline *parse_pipeline(char **arglist, int background);
+void parse_cache_clear();
+int run_pipeline(Pipeline *pl);
+int exit_code(int status);
+void report_times(Pipeline *pl);
+static void set_pipe_size(int fd, int *warned);
+static void relay_links(PipeLink *links, int nlinks);
+static void report_links(Pipeline *pl, PipeLink *links);
+int time_builtin(Builtin *builtin, Stage *st, int timed, const char *text);
+int run_builtin(Builtin *builtin, char **argv, int fds[3]);
+static int run_builtin_stage(Builtin *builtin, Stage *st);
+void run_command(char *cmdline);
+static void run_parsed(Pipeline *pl, const char *text);
+static Pipeline *parse_simple(char **arglist, int background, int *error);
+static int parse_priority(char ***args, int *nice, int *ioprio);
+static int starts_compound(const char *cmdline);
+static int open_redirect(const char *file, int flags, const char *what);
+int run_batch(int fd);
+void run_string(char *str);
+static void compound_eof();
+static int heredoc_scan(const char *cmdline);
+static int heredoc_add_line(const char *line);
+static void heredoc_reset();
+static int here_fd(const char *body);
+void reap_children();
+void event_loop();
+static void on_sigint(int signum);
+void line_handler(char *cmdline);
+
+// History log functions
+void history_open();
+void history_append(const char *line);
+void history_flush();
+int history_tick();
+int history_timeout();
+void history_close();
+void history_compact();
+void history_load();
+int history_load_older();
+char *history_line(long n);
+long history_total();
+char *history_find(const char *text, int prefix);
+int history_search_print(const char *text);
+void history_search_add(long n, const char *line, size_t len);
+static long ms_since(const struct timespec *then);
+
+// Prompt functions
 void display_prompt(char *prompt);
-void add_job(pid_t pid, const char *command);
+void update_cwd();
+void prompt_worker_start();
+void prompt_worker_read();
+int prompt_timeout();
+void prompt_tick();
+static void segment_took(PromptSegment *seg);
+static void segment_vcs(int index, int fd);
+static void segment_load(int index, int fd);
+
+// Job control functions
+int add_job(Pipeline *pl, pid_t pgid);
+Job *find_job(int job_id);
+int find_job_by_pid(pid_t pid);
+void reap_pid(pid_t pid, int status);
+void remove_job(int slot);
 void list_jobs();
-void kill_job(pid_t pid);
+void kill_job(int job_id);
 int are_jobs_present();
+void coproc_exited(pid_t pid);
+static int cgroup_setup();
+static int cgroup_job_create(int *id);
+static void cgroup_job_remove(int id);
+static void cgroup_cleanup();
+static void describe_limits(const Pipeline *pl, char *buf, size_t size);
+static void format_rlimit(rlim_t value, rlim_t unit, const char *suffix, char *buf, size_t size);
+
+// Tracing functions
+void trace_init();
+long long trace_clock();
+void trace_record(const char *name, long long start, long long end, pid_t tid);
+int trace_write(const char *path);
+void trace_close();
+
+// Arena allocator functions
+void *arena_alloc(Arena *arena, size_t size);
+char *arena_strdup(Arena *arena, const char *str);
+void arena_reset(Arena *arena);
+ArenaMark arena_mark(Arena *arena);
+void arena_release(Arena *arena, ArenaMark mark);
+
+// Command hash functions
+unsigned hash_string(const char *str);
+unsigned hash_bytes(const char *str, size_t len);
+const char *hash_lookup(const char *name);
+const char *hash_command(const char *name);
+void hash_clear();
+void hash_list();
+
+// Completion functions
+void command_index_clear();
+char **shell_completion(const char *text, int start, int end);
+
+// Process spawning functions
+pid_t spawn_fork(SpawnRequest *req);
+pid_t spawn_vfork(SpawnRequest *req);
+pid_t spawn_posix(SpawnRequest *req);
+pid_t spawn_clone(SpawnRequest *req);
+
+// Shell option functions
+int set_option(const char *name, const char *value);
+void list_options();
+
+// Variable handling functions
+void import_environment();
+Var *find_var(const char *name, size_t len);
+int set_var(const char *name, const char *value, int global);
+int remove_var(const char *name);
+void unset_var(const char *name);
+const char *get_var(const char *name);
+void list_vars(int all);
+void expand_variables(char **arglist);
+const char *expand_word(const char *word);
+
+SpawnBackend spawn_backends[] = {
+    {"fork", spawn_fork},
+    {"vfork", spawn_vfork},
+    {"posix_spawn", spawn_posix},
+    {"clone", spawn_clone},
+};
+const char *const spawn_modes[] = {"fork", "vfork", "posix_spawn", "clone", NULL};
+int spawn_mode = 0;   // Index into spawn_backends
+
+enum { SYNC_NONE, SYNC_FLUSH, SYNC_EXIT };
+const char *const history_sync_modes[] = {"none", "flush", "exit", NULL};
+int history_sync = SYNC_NONE;
+int history_batch = 1;        // Entries buffered before a flush
+int history_flush_ms = 1000;  // Longest time an entry stays buffered
+
+const char *const on_off[] = {"off", "on", NULL};
+int prompt_vcs = 0;           // Repository branch, `*` when it has changes
+int prompt_load = 0;          // One-minute load average
+int prompt_took_ms = 2000;    // Show a command's wall time from this long; 0: never
+int prompt_timeout_ms = 500;  // Deadline of the prompt worker
+int pipe_size = 0;            // F_SETPIPE_SZ of pipeline pipes; 0: kernel default
+int pipe_stats = 0;           // Relay foreground pipelines and report each pipe
+int job_cgroup = 0;           // Place each job in its own cgroup v2 group
+int cgroup_cpu_pct = 0;       // cpu.max of a job group in percent of one CPU; 0: no limit
+int cgroup_memory_mb = 0;     // memory.max of a job group; 0: no limit
+
+const char *const ioprio_classes[] = {"none", "realtime", "best-effort", "idle", NULL};
+
+UlimitResource ulimit_resources[] = {
+    {'c', RLIMIT_CORE, 1024, "core", "core file size (KiB)"},
+    {'d', RLIMIT_DATA, 1024, "data", "data segment size (KiB)"},
+    {'f', RLIMIT_FSIZE, 1024, "fsize", "file size (KiB)"},
+    {'l', RLIMIT_MEMLOCK, 1024, "memlock", "locked memory (KiB)"},
+    {'n', RLIMIT_NOFILE, 1, "nofile", "open files"},
+    {'s', RLIMIT_STACK, 1024, "stack", "stack size (KiB)"},
+    {'t', RLIMIT_CPU, 1, "cpu", "cpu time (seconds)"},
+    {'u', RLIMIT_NPROC, 1, "nproc", "user processes"},
+    {'v', RLIMIT_AS, 1024, "as", "virtual memory (KiB)"},
+};
+#define NUM_ULIMITS (int)(sizeof(ulimit_resources) / sizeof(ulimit_resources[0]))
+struct rlimit ulimit_values[RLIM_NLIMITS];  // Set in each child before exec
+unsigned ulimit_set;                        // Bit per resource given to `ulimit`
+
+char cgroup_jobs[PATH_MAX];  // Group holding the job groups, empty until set up
+int cgroup_next_id;
+
+ShellOption options[] = {
+    {"spawn", spawn_modes, &spawn_mode, "how external commands are started"},
+    {"history_batch", NULL, &history_batch, "history entries written per flush"},
+    {"history_flush_ms", NULL, &history_flush_ms, "flush buffered history after this many ms"},
+    {"history_sync", history_sync_modes, &history_sync, "when history is fsync()ed"},
+    {"parse_cache", NULL, &parse_cache_max, "command lines whose parse is remembered"},
+    {"prompt_vcs", on_off, &prompt_vcs, "show the git branch and changes in the prompt"},
+    {"prompt_load", on_off, &prompt_load, "show the load average in the prompt"},
+    {"prompt_took_ms", NULL, &prompt_took_ms, "show commands that took this long (0: never)"},
+    {"prompt_timeout_ms", NULL, &prompt_timeout_ms, "stop computing slow prompt parts after this"},
+    {"pipe_size", NULL, &pipe_size, "buffer size of pipeline pipes in bytes (0: kernel default)"},
+    {"pipe_stats", on_off, &pipe_stats, "report bytes and full/empty time of each pipeline pipe"},
+    {"cgroup", on_off, &job_cgroup, "run each job in its own cgroup v2 group"},
+    {"cgroup_cpu_pct", NULL, &cgroup_cpu_pct, "cpu.max of each job group in % of a CPU (0: no limit)"},
+    {"cgroup_memory_mb", NULL, &cgroup_memory_mb, "memory.max of each job group in MiB (0: no limit)"},
+};
+#define NUM_OPTIONS (int)(sizeof(options) / sizeof(options[0]))
+
+PromptSegment prompt_segments[] = {
+    {"vcs", &prompt_vcs, NULL, segment_vcs, 1},
+    {"load", &prompt_load, NULL, segment_load, 0},
+    {"took", &prompt_took_ms, segment_took, NULL, 0},
+};
+#define NUM_SEGMENTS (int)(sizeof(prompt_segments) / sizeof(prompt_segments[0]))
+
+int main(int argc, char *argv[]) {
+    // SIGCHLD is never delivered asynchronously: it is read from a signalfd
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &orig_sigmask);
+    sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigchld_fd < 0) {
+        perror("signalfd");
+        return 1;
+    }
+    trace_init();
+    import_environment();
+    update_cwd();
+
+    // Non-interactive modes: no prompt, no readline and no history
+    if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+        run_string(argv[2]);
+        return last_status;
+    } else if (argc > 1) {
+        int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            perror(argv[1]);
+            return 127;
+        }
+        run_batch(fd);
+        close(fd);
+        return last_status;
+    } else if (!isatty(STDIN_FILENO)) {
+        run_batch(STDIN_FILENO);
+        return last_status;
+    }
+
+    interactive = 1;
+    signal(SIGTTOU, SIG_IGN);  // Needed to take the terminal back from pipelines
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigint;  // Ctrl-C stops loops and clears the input line
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &sa, NULL);
+    using_history();
+    history_open();
+    rl_attempted_completion_function = shell_completion;
+
+    event_loop();
+
+    printf("\n");
+    return 0;  // history_close() runs from atexit()
+}
+
+// Ctrl-C only sets a flag: running loops stop and the prompt drops its line
+static void on_sigint(int signum) {
+    interrupted = 1;
+}
+
+// Throw away the line being typed (and any unfinished compound command)
+// after Ctrl-C at the prompt
+static void cancel_input() {
+    interrupted = 0;
+    compound_len = 0;
+    heredoc_reset();
+    rl_free_line_state();
+    rl_callback_sigcleanup();
+    rl_crlf();
+    rl_callback_handler_remove();
+    display_prompt(prompt);
+    rl_callback_handler_install(prompt, line_handler);
+    prompt_worker_start();
+}
+
+// Wait for terminal input, finished children and history flush deadlines
+// on one thread, feeding input to readline's callback interface
+void event_loop() {
+    int ep = event_ep = epoll_create1(EPOLL_CLOEXEC);
+    if (ep < 0) {
+        perror("epoll_create1");
+        return;
+    }
+    struct epoll_event ev = {.events = EPOLLIN};
+    ev.data.fd = STDIN_FILENO;
+    epoll_ctl(ep, EPOLL_CTL_ADD, STDIN_FILENO, &ev);
+    ev.data.fd = sigchld_fd;
+    epoll_ctl(ep, EPOLL_CTL_ADD, sigchld_fd, &ev);
+
+    display_prompt(prompt);
+    rl_callback_handler_install(prompt, line_handler);
+    prompt_active = 1;
+    trace_read_start = TRACE_BEGIN();
+    prompt_worker_start();
+
+    while (!shell_done) {
+        struct epoll_event events[4];
+        int timeout = history_timeout();
+        int prompt_left = prompt_timeout();
+        if (prompt_left >= 0 && (timeout < 0 || prompt_left < timeout)) timeout = prompt_left;
+        int n = epoll_wait(ep, events, 4, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                if (interrupted) cancel_input();
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        if (n == 0) {
+            history_tick();
+            prompt_tick();
+        }
+        for (int i = 0; i < n && !shell_done; i++) {
+            if (events[i].data.fd == sigchld_fd) {
+                reap_children();
+            } else if (events[i].data.fd == prompt_worker_fd) {
+                prompt_worker_read();
+            } else if (events[i].data.fd == path_inotify_fd) {
+                command_index_clear();  // One event is enough to know it is stale
+            } else {
+                rl_callback_read_char();
+            }
+        }
+    }
+
+    if (prompt_active) rl_callback_handler_remove();
+    close(ep);
+}
+
+// Called by readline with each complete line (NULL on EOF)
+void line_handler(char *cmdline) {
+    // Give the terminal back to its normal mode while the command runs
+    rl_callback_handler_remove();
+    prompt_active = 0;
+    TRACE_END("readline", trace_read_start);
+
+    if (!cmdline) {  // Exit on EOF
+        shell_done = 1;
+        return;
+    }
+
+    if (cmdline[0] != '\0') {
+        long long t = TRACE_BEGIN();
+        add_history(cmdline);
+        history_append(cmdline);
+        if (trigrams) history_search_add(history_total(), cmdline, strlen(cmdline));
+        TRACE_END("add_history", t);
+    }
+
+    // Handle command repetition with `!!`, `!number`, `!?text?` and `!text`
+    if (cmdline[0] == '!') {
+        char *line = NULL;
+        if (cmdline[1] == '!') {  // Repeat the last command
+            HIST_ENTRY *entry = previous_history();
+            line = entry ? strdup(entry->line) : NULL;
+        } else if (cmdline[1] == '?') {  // Newest command containing text
+            char *end = strchr(cmdline + 2, '?');
+            if (end) *end = '\0';
+            line = history_find(cmdline + 2, 0);
+        } else if (isdigit((unsigned char)cmdline[1])) {
+            line = history_line(atol(cmdline + 1));
+        } else if (cmdline[1] != '\0') {  // Newest command starting with text
+            line = history_find(cmdline + 1, 1);
+        }
+
+        if (line) {
+            free(cmdline);
+            cmdline = line;
+            printf("Repeating command: %s\n", cmdline);
+        } else {
+            printf("No such command in history.\n");
+            free(cmdline);
+            cmdline = NULL;
+        }
+    }
+
+    if (cmdline) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        run_command(cmdline);
+        last_command_ms = ms_since(&start);
+        free(cmdline);
+    }
+
+    display_prompt(prompt);
+    rl_callback_handler_install(compound_pending() ? "> " : prompt, line_handler);
+    prompt_active = 1;
+    trace_read_start = TRACE_BEGIN();
+    if (!compound_pending()) prompt_worker_start();
+}
+
+// Parse and run one command line, leaving its exit status in last_status
+void run_command(char *cmdline) {
+    int error = 0;
+    long long t = TRACE_BEGIN();
+    long long t_cmd = t;
+    interrupted = 0;
+
+    // A line with here-documents runs once the lines after it have
+    // supplied every body
+    if (heredoc_filled < heredoc_count) {
+        if (!heredoc_add_line(cmdline)) return;
+        cmdline = heredoc_line;
+    } else if (heredoc_scan(cmdline)) {
+        return;
+    }
+
+    // Lists and compound commands go through the control-flow parser
+    if (compound_len > 0 || starts_compound(cmdline)) {
+        run_compound(cmdline);
+    } else {
+        Pipeline *pl = parse_line(cmdline, &error);
+        TRACE_END("parse", t);
+        if (pl == NULL) {
+            if (error) last_status = error;
+        } else {
+            run_parsed(pl, cmdline);
+        }
+    }
+    if (compound_len == 0) heredoc_reset();  // A loop keeps its bodies until it is complete
+    arena_reset(&cmd_arena);  // Release every token of this command at once
+    t = TRACE_BEGIN();
+    reap_children();  // Collect background jobs that finished meanwhile
+    TRACE_END("reap_children", t);
+    TRACE_END("command", t_cmd);
+}
+
+// Expand and run one parsed pipeline, leaving its status in last_status
+static void run_parsed(Pipeline *pl, const char *text) {
+    long long t = TRACE_BEGIN();
+    for (int i = 0; i < pl->nstages; i++) {  // Expand variables in the command
+        Stage *st = &pl->stages[i];
+        expand_variables(st->argv);
+        if (st->in_file) st->in_file = expand_word(st->in_file);
+        if (st->here && !st->here_literal) st->here = expand_word(st->here);
+        if (st->out_file) st->out_file = expand_word(st->out_file);
+        if (st->err_file) st->err_file = expand_word(st->err_file);
+    }
+    TRACE_END("expand_variables", t);
+
+    char **arglist = pl->stages[0].argv;
+    Builtin *builtin = pl->builtin;
+    if (pl->name_expands && arglist[0]) builtin = find_builtin(arglist[0]);
+    if (arglist[0] == NULL && pl->nstages == 1) {
+        last_status = 0;  // Only variables that expanded to nothing
+    } else if (builtin && pl->nstages == 1 && !pl->background && pl->timed) {
+        last_status = time_builtin(builtin, &pl->stages[0], pl->timed, text);
+    } else if (builtin && pl->nstages == 1 && !pl->background) {  // If it's a built-in command
+        last_status = run_builtin_stage(builtin, &pl->stages[0]);
+    } else {
+        // External commands, and pipelines that may contain built-ins
+        pl->text = text;
+        if (pl->background) pl->timed = TIME_OFF;  // Nobody waits for a background job
+        last_status = exit_code(run_pipeline(pl));
+    }
+}
+
+// Run every complete line in buf[0..len) and return the bytes consumed.
+// With fd >= 0, buf was read from fd and ends at its offset; each line
+// runs with the offset just after it, and a command that moves the offset
+// (by reading on) ends the run, as the rest of buf is stale.
+static size_t run_lines(char *buf, size_t len, int fd) {
+    char *line = buf;
+    char *end = buf + len;
+    char *nl;
+    off_t base = fd >= 0 ? lseek(fd, 0, SEEK_CUR) - (off_t)len : 0;
+    while ((nl = memchr(line, '\n', end - line)) != NULL) {
+        *nl = '\0';
+        off_t next = base + (nl + 1 - buf);
+        if (fd >= 0) lseek(fd, next, SEEK_SET);
+        run_command(line);
+        line = nl + 1;
+        if (fd >= 0 && lseek(fd, 0, SEEK_CUR) != next) break;
+    }
+    return line - buf;
+}
+
+// Non-interactive input: read large blocks and split them into lines.
+// When the input is the shell's stdin, commands must find the lines after
+// their own there, so nothing is consumed ahead: seekable input is rewound
+// to the end of each line as it runs, and a pipe is read a byte at a time,
+// as `read` does.
+int run_batch(int fd) {
+    int shared = fd == STDIN_FILENO;
+    int seekable = shared && lseek(fd, 0, SEEK_CUR) != -1;
+    size_t cap = BATCH_BUFSIZE;
+    size_t len = 0;
+    char *buf = malloc(cap + 1);
+    if (!buf) {
+        perror("malloc() failed for input buffer");
+        return -1;
+    }
+
+    while (1) {
+        if (len == cap) {  // A single line longer than the buffer
+            char *bigger = realloc(buf, cap * 2 + 1);
+            if (!bigger) {
+                perror("realloc() failed for input buffer");
+                break;
+            }
+            buf = bigger;
+            cap *= 2;
+        }
+        ssize_t n = read(fd, buf + len, shared && !seekable ? 1 : cap - len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("read");
+            break;
+        }
+        if (n == 0) {  // EOF: run a final unterminated line
+            if (len > 0) {
+                buf[len] = '\0';
+                run_command(buf);
+            }
+            compound_eof();
+            break;
+        }
+        len += n;
+        size_t used = run_lines(buf, len, seekable ? fd : -1);
+        if (seekable && used > 0) {
+            len = 0;  // The next read starts where the last command left fd
+        } else {
+            memmove(buf, buf + used, len - used);
+            len -= used;
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+// Run the lines of a -c argument
+void run_string(char *str) {
+    size_t len = strlen(str);
+    size_t used = run_lines(str, len, -1);
+    if (used < len) run_command(str + used);
+    compound_eof();
+}
+
+// Turn tracing on when TRACE_ENV names an output file
+void trace_init() {
+    trace_path = getenv(TRACE_ENV);
+    if (!trace_path || !*trace_path) return;
+    trace_events = malloc(sizeof(TraceEvent) * TRACE_EVENTS);
+    if (!trace_events) {
+        perror("trace");
+        return;
+    }
+    atexit(trace_close);
+}
+
+long long trace_clock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Store one event; end == 0 means now
+void trace_record(const char *name, long long start, long long end, pid_t tid) {
+    if (!trace_events) return;
+    TraceEvent *ev = &trace_events[trace_count++ % TRACE_EVENTS];
+    ev->name = name;
+    ev->start = start;
+    ev->dur = (end ? end : trace_clock()) - start;
+    ev->tid = tid;
+}
+
+// Write the buffered events as Chrome trace JSON and empty the buffer
+int trace_write(const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+    pid_t pid = getpid();
+    unsigned long first = trace_count > TRACE_EVENTS ? trace_count - TRACE_EVENTS : 0;
+    fprintf(fp, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    fprintf(fp, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"myShell\"}}", pid);
+    for (unsigned long i = first; i < trace_count; i++) {
+        TraceEvent *ev = &trace_events[i % TRACE_EVENTS];
+        fprintf(fp, ",\n{\"name\": \"%s\", \"cat\": \"shell\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                "\"pid\": %d, \"tid\": %d}",
+                ev->name, ev->start / 1e3, ev->dur / 1e3, pid, ev->tid ? ev->tid : pid);
+    }
+    fprintf(fp, "\n]}\n");
+    trace_count = 0;
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+void trace_close() {
+    if (trace_events && trace_count > 0) trace_write(trace_path);
+}
+
+static const char *const reserved_words[] = {"do", "done", "elif", "else", "fi", "for", "if", "then", "while", NULL};
+
+static int word_in(const char *word, const char *const *list) {
+    for (; list && *list; list++) {
+        if (strcmp(word, *list) == 0) return 1;
+    }
+    return 0;
+}
+
+// Whether a line needs the compound parser: it has a `;`, an `&` that
+// is followed by another command, or its first word opens a compound
+// command (or is a stray keyword, which the compound parser reports)
+static int starts_compound(const char *cmdline) {
+    if (strchr(cmdline, ';')) return 1;
+    for (const char *amp = strchr(cmdline, '&'); amp; amp = strchr(amp + 1, '&')) {
+        if (amp[strspn(amp + 1, " \t") + 1] != '\0') return 1;
+    }
+    while (*cmdline == ' ' || *cmdline == '\t') cmdline++;
+    size_t len = strcspn(cmdline, " \t");
+    for (const char *const *w = reserved_words; *w; w++) {
+        if (strlen(*w) == len && strncmp(cmdline, *w, len) == 0) return 1;
+    }
+    return 0;
+}
+
+// A compound command or a here-document still needs more lines
+int compound_pending() {
+    return compound_len > 0 || heredoc_filled < heredoc_count;
+}
+
+static int parser_at(Parser *p, const char *word) {
+    return p->tok[p->pos] && strcmp(p->tok[p->pos], word) == 0;
+}
+
+static int parser_expect(Parser *p, const char *word) {
+    if (p->error) return 0;
+    if (!p->tok[p->pos]) {
+        p->error = PARSE_MORE;  // Wait for the next line
+        return 0;
+    }
+    if (strcmp(p->tok[p->pos], word) != 0) {
+        fprintf(stderr, "syntax error near `%s', expected `%s'\n", p->tok[p->pos], word);
+        p->error = PARSE_ERROR;
+        return 0;
+    }
+    p->pos++;
+    return 1;
+}
+
+static Node *parse_list(Parser *p, const char *const *stops);
+
+static Node *new_node(Parser *p, int type) {
+    Node *node = arena_alloc(&cmd_arena, sizeof(Node));
+    if (!node) {
+        p->error = PARSE_ERROR;
+        return NULL;
+    }
+    memset(node, 0, sizeof(Node));
+    node->type = type;
+    return node;
+}
+
+static const char *const stops_do[] = {"do", NULL};
+static const char *const stops_done[] = {"done", NULL};
+static const char *const stops_then[] = {"then", NULL};
+static const char *const stops_else[] = {"elif", "else", "fi", NULL};
+static const char *const stops_fi[] = {"fi", NULL};
+
+// The rest of an `if` or `elif`, up to and including its `fi`
+static Node *parse_if(Parser *p) {
+    Node *node = new_node(p, NODE_IF);
+    if (!node) return NULL;
+    node->cond = parse_list(p, stops_then);
+    if (!parser_expect(p, "then")) return NULL;
+    node->body = parse_list(p, stops_else);
+    if (p->error) return NULL;
+    if (parser_at(p, "elif")) {
+        p->pos++;
+        node->orelse = parse_if(p);  // Consumes the shared `fi`
+        return p->error ? NULL : node;
+    }
+    if (parser_at(p, "else")) {
+        p->pos++;
+        node->orelse = parse_list(p, stops_fi);
+    }
+    return parser_expect(p, "fi") ? node : NULL;
+}
+
+static Node *parse_command(Parser *p) {
+    char *word = p->tok[p->pos];
+    if (strcmp(word, "for") == 0) {
+        Node *node = new_node(p, NODE_FOR);
+        if (!node) return NULL;
+        p->pos++;
+        node->var = p->tok[p->pos];
+        if (!node->var) {
+            p->error = PARSE_MORE;
+            return NULL;
+        }
+        p->pos++;
+        if (!parser_expect(p, "in")) return NULL;
+        int start = p->pos;
+        while (p->tok[p->pos] && !parser_at(p, ";")) p->pos++;
+        if (!p->tok[p->pos]) {
+            p->error = PARSE_MORE;
+            return NULL;
+        }
+        int count = p->pos - start;
+        node->words = arena_alloc(&cmd_arena, sizeof(char *) * (count + 1));
+        if (!node->words) {
+            p->error = PARSE_ERROR;
+            return NULL;
+        }
+        memcpy(node->words, p->tok + start, sizeof(char *) * count);
+        node->words[count] = NULL;
+        p->pos++;  // The `;`
+        while (parser_at(p, ";")) p->pos++;
+        if (!parser_expect(p, "do")) return NULL;
+        node->body = parse_list(p, stops_done);
+        return parser_expect(p, "done") ? node : NULL;
+    }
+    if (strcmp(word, "while") == 0) {
+        Node *node = new_node(p, NODE_WHILE);
+        if (!node) return NULL;
+        p->pos++;
+        node->cond = parse_list(p, stops_do);
+        if (!parser_expect(p, "do")) return NULL;
+        node->body = parse_list(p, stops_done);
+        return parser_expect(p, "done") ? node : NULL;
+    }
+    if (strcmp(word, "if") == 0) {
+        p->pos++;
+        return parse_if(p);
+    }
+    if (word_in(word, reserved_words)) {
+        fprintf(stderr, "syntax error near unexpected `%s'\n", word);
+        p->error = PARSE_ERROR;
+        return NULL;
+    }
+
+    // Simple command: every word up to the next `;` or `&`
+    int start = p->pos;
+    while (p->tok[p->pos] && !parser_at(p, ";") && !parser_at(p, "&")) p->pos++;
+    int count = p->pos - start;
+    int background = parser_at(p, "&");
+    if (count == 0) {
+        fprintf(stderr, "syntax error near unexpected `&'\n");
+        p->error = PARSE_ERROR;
+        return NULL;
+    }
+    if (background) p->pos++;  // Ends the command like `;`
+    char **arglist = arena_alloc(&cmd_arena, sizeof(char *) * (count + 1));
+    Node *node = new_node(p, NODE_COMMAND);
+    if (!arglist || !node) {
+        p->error = PARSE_ERROR;
+        return NULL;
+    }
+    memcpy(arglist, p->tok + start, sizeof(char *) * count);
+    arglist[count] = NULL;
+
+    // Its words again, for the job table and `time`
+    size_t size = 1;
+    for (int i = 0; i < count; i++) size += strlen(arglist[i]) + 1;
+    char *text = arena_alloc(&cmd_arena, size);
+    if (!text) {
+        p->error = PARSE_ERROR;
+        return NULL;
+    }
+    text[0] = '\0';
+    for (int i = 0; i < count; i++) {
+        if (i > 0) strcat(text, " ");
+        strcat(text, arglist[i]);
+    }
+    node->text = text;
+
+    int error = 0;
+    node->pl = parse_simple(arglist, background, &error);
+    if (!node->pl) {
+        p->error = PARSE_ERROR;
+        return NULL;
+    }
+    return node;
+}
+
+// Commands separated by `;`, up to one of the stop words (or the end)
+static Node *parse_list(Parser *p, const char *const *stops) {
+    Node *head = NULL, **tail = &head;
+    while (!p->error) {
+        while (parser_at(p, ";")) p->pos++;
+        char *word = p->tok[p->pos];
+        if (!word) {
+            if (stops) p->error = PARSE_MORE;  // Still inside a compound command
+            break;
+        }
+        if (word_in(word, stops)) break;
+        Node *node = parse_command(p);
+        if (!node) break;
+        *tail = node;
+        tail = &node->next;
+        word = p->tok[p->pos];
+        int after_amp = strcmp(p->tok[p->pos - 1], "&") == 0;
+        if (word && !after_amp && strcmp(word, ";") != 0 && !word_in(word, stops)) {
+            fprintf(stderr, "syntax error near unexpected `%s'\n", word);
+            p->error = PARSE_ERROR;
+        }
+    }
+    return head;
+}
+
+// Copy a parsed pipeline so expansion can rewrite the copy's argv arrays
+static Pipeline *pipeline_copy(const Pipeline *src) {
+    Pipeline *pl = arena_alloc(&cmd_arena, sizeof(Pipeline));
+    Stage *stages = arena_alloc(&cmd_arena, sizeof(Stage) * src->nstages);
+    if (!pl || !stages) return NULL;
+    *pl = *src;
+    pl->stages = stages;
+    for (int i = 0; i < src->nstages; i++) {
+        const Stage *from = &src->stages[i];
+        int argc = 0;
+        while (from->argv[argc]) argc++;
+        stages[i] = *from;
+        stages[i].argv = arena_alloc(&cmd_arena, sizeof(char *) * (argc + 1));
+        if (!stages[i].argv) return NULL;
+        memcpy(stages[i].argv, from->argv, sizeof(char *) * (argc + 1));
+    }
+    return pl;
+}
+
+static void run_node(Node *node) {
+    switch (node->type) {
+    case NODE_COMMAND: {
+        // Whatever the command allocates is released once it has run
+        ArenaMark mark = arena_mark(&cmd_arena);
+        Pipeline *pl = pipeline_copy(node->pl);
+        if (pl) run_parsed(pl, node->text);
+        arena_release(&cmd_arena, mark);
+        break;
+    }
+    case NODE_FOR: {
+        ArenaMark mark = arena_mark(&cmd_arena);
+        int count = 0;
+        while (node->words[count]) count++;
+        char **values = arena_alloc(&cmd_arena, sizeof(char *) * (count + 1));
+        if (!values) break;
+        memcpy(values, node->words, sizeof(char *) * (count + 1));
+        expand_variables(values);
+        last_status = 0;
+        for (int i = 0; values[i] && !interrupted; i++) {
+            set_var(node->var, values[i], 0);
+            run_list(node->body);
+        }
+        arena_release(&cmd_arena, mark);
+        break;
+    }
+    case NODE_WHILE: {
+        int status = 0;
+        while (!interrupted) {
+            run_list(node->cond);
+            if (last_status != 0 || interrupted) break;
+            run_list(node->body);
+            status = last_status;
+        }
+        last_status = status;
+        break;
+    }
+    case NODE_IF:
+        run_list(node->cond);
+        if (interrupted) break;
+        if (last_status == 0) {
+            run_list(node->body);
+        } else if (node->orelse) {
+            run_list(node->orelse);
+        } else {
+            last_status = 0;
+        }
+        break;
+    }
+}
+
+void run_list(Node *node) {
+    for (; node && !interrupted; node = node->next) run_node(node);
+}
+
+// Run a line holding `;` lists or compound commands. Lines are collected
+// until every `for`/`while`/`if` is closed; then the whole text is parsed
+// once into nodes and run.
+void run_compound(const char *cmdline) {
+    size_t len = strlen(cmdline);
+    if (compound_len + len + 3 > compound_cap) {
+        size_t cap = compound_cap ? compound_cap : 256;
+        while (cap < compound_len + len + 3) cap *= 2;
+        char *bigger = realloc(compound_buf, cap);
+        if (!bigger) {
+            perror("realloc() failed for compound command");
+            compound_len = 0;
+            return;
+        }
+        compound_buf = bigger;
+        compound_cap = cap;
+    }
+    if (compound_len > 0) compound_buf[compound_len++] = ';';  // Line breaks end commands
+    memcpy(compound_buf + compound_len, cmdline, len + 1);
+    compound_len += len;
+
+    long long t = TRACE_BEGIN();
+    int background = 0;
+    char **toks = tokenize(compound_buf, &background);
+    if (!toks) {
+        compound_len = 0;
+        return;
+    }
+    Parser p = {toks, 0, PARSE_OK};
+    heredoc_used = 0;  // Every line so far is parsed again
+    Node *list = parse_list(&p, NULL);
+    TRACE_END("parse", t);
+    if (p.error == PARSE_MORE) return;  // Needs more lines
+    compound_len = 0;
+    if (p.error) {
+        last_status = 2;
+        return;
+    }
+
+    if (background) {  // The trailing `&` applies to the last command
+        Node *last = list;
+        while (last && last->next) last = last->next;
+        if (!last || last->type != NODE_COMMAND) {
+            fprintf(stderr, "compound commands cannot run in the background\n");
+            last_status = 2;
+            return;
+        }
+        last->pl->background = 1;
+    }
+    run_list(list);
+}
+
+// End of input inside an unfinished compound command
+static void compound_eof() {
+    if (heredoc_filled < heredoc_count) {
+        fprintf(stderr, "warning: here-document ended by end of file (wanted `%s')\n",
+                heredocs[heredoc_filled].delim);
+        while (heredoc_filled < heredoc_count) run_command(heredocs[heredoc_filled].delim);
+    }
+    if (compound_len == 0) return;
+    fprintf(stderr, "syntax error: unexpected end of file\n");
+    compound_len = 0;
+    heredoc_reset();
+    last_status = 2;
+}
+
+// Register the here-documents a line opens with `<<` or `<<-`, with the
+// delimiter as the next word or attached (`<<EOF`). Returns 1 when the
+// line has to wait for their bodies. Words are split the way tokenize()
+// splits them, so the parser meets the same operators.
+static int heredoc_scan(const char *cmdline) {
+    if (!strstr(cmdline, "<<")) return 0;
+    int opened = 0;
+    const char *cp = cmdline;
+    while (*cp != '\0') {
+        cp += strspn(cp, " \t;");
+        const char *word = cp;
+        size_t len = strcspn(cp, " \t;");
+        cp += len;
+        size_t op = here_op_len(word, len);
+        if (op) {
+            if (word[2] == '<') continue;  // A here-string
+            len = op;
+        }
+        int strip_tabs = len == 3 && strncmp(word, "<<-", 3) == 0;
+        if (!strip_tabs && !(len == 2 && strncmp(word, "<<", 2) == 0)) continue;
+
+        if (op) {  // The delimiter is the rest of the word
+            cp = word + op;
+        } else {
+            cp += strspn(cp, " \t");
+        }
+        len = strcspn(cp, " \t;");
+        if (len == 0) break;  // parse_pipeline() reports the missing word
+        if (heredoc_count == HEREDOC_MAX) {
+            fprintf(stderr, "too many here-documents\n");
+            heredoc_reset();
+            last_status = 2;
+            return 1;
+        }
+        HereDoc *h = &heredocs[heredoc_count++];
+        memset(h, 0, sizeof(*h));
+        h->strip_tabs = strip_tabs;
+        if (len >= 2 && (*cp == '\'' || *cp == '"') && cp[len - 1] == *cp) {
+            h->literal = 1;  // <<'EOF': the body is taken as it is
+            h->delim = strndup(cp + 1, len - 2);
+        } else {
+            h->delim = strndup(cp, len);
+        }
+        if (!h->delim) {
+            perror("strndup() failed for here-document");
+            heredoc_reset();
+            return 1;
+        }
+        cp += len;
+        opened = 1;
+    }
+    if (!opened) return 0;
+
+    free(heredoc_line);
+    heredoc_line = strdup(cmdline);
+    if (!heredoc_line) {
+        perror("strdup() failed for here-document");
+        heredoc_reset();
+    }
+    return 1;
+}
+
+// Add a line to the body being read. Returns 1 once the last body is
+// complete and the line that opened them can run.
+static int heredoc_add_line(const char *line) {
+    HereDoc *h = &heredocs[heredoc_filled];
+    if (h->strip_tabs) line += strspn(line, "\t");
+    if (strcmp(line, h->delim) == 0) return ++heredoc_filled == heredoc_count;
+
+    size_t len = strlen(line);
+    if (h->len + len + 2 > h->cap) {
+        size_t cap = h->cap ? h->cap : 256;
+        while (cap < h->len + len + 2) cap *= 2;
+        char *bigger = realloc(h->body, cap);
+        if (!bigger) {
+            perror("realloc() failed for here-document");
+            return 0;  // The line is lost, the body goes on
+        }
+        h->body = bigger;
+        h->cap = cap;
+    }
+    memcpy(h->body + h->len, line, len);
+    h->len += len;
+    h->body[h->len++] = '\n';
+    h->body[h->len] = '\0';
+    return 0;
+}
+
+static void heredoc_reset() {
+    for (int i = 0; i < heredoc_count; i++) {
+        free(heredocs[i].delim);
+        free(heredocs[i].body);
+    }
+    heredoc_count = heredoc_filled = heredoc_used = 0;
+    free(heredoc_line);
+    heredoc_line = NULL;
+}
+
+static long ms_since(const struct timespec *then) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - then->tv_sec) * 1000 + (now.tv_nsec - then->tv_nsec) / 1000000;
+}
+
+void history_open() {
+    // Remember the absolute path so `cd` does not move the log
+    snprintf(history_path, sizeof(history_path), "%s/%s", shell_cwd, HISTORY_FILE);
+    history_fd = open(history_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (history_fd < 0) {
+        perror("history");
+        return;
+    }
+    history_load();
+    atexit(history_close);
+    if (history_entries > 2 * HISTORY_KEEP) history_compact();
+}
+
+// Queue an entry for the log, flushing once the batch is full or old
+void history_append(const char *line) {
+    size_t len = strlen(line);
+    if (history_pending_len + len + 1 > history_pending_cap) {
+        size_t cap = history_pending_cap ? history_pending_cap : 4096;
+        while (cap < history_pending_len + len + 1) cap *= 2;
+        char *bigger = realloc(history_pending, cap);
+        if (!bigger) {
+            perror("realloc() failed for history");
+            return;
+        }
+        history_pending = bigger;
+        history_pending_cap = cap;
+    }
+    if (history_pending_count == 0) clock_gettime(CLOCK_MONOTONIC, &history_pending_since);
+    memcpy(history_pending + history_pending_len, line, len);
+    history_pending[history_pending_len + len] = '\n';
+    history_pending_len += len + 1;
+    history_pending_count++;
+
+    if (history_pending_count >= history_batch ||
+        ms_since(&history_pending_since) >= history_flush_ms) {
+        history_flush();
+    }
+}
+
+// Write all buffered entries. A shared lock keeps appends out of a running
+// compaction, and the fd is reopened if the log was replaced meanwhile.
+void history_flush() {
+    if (history_pending_count == 0 || history_fd < 0) return;
+
+    long long t = TRACE_BEGIN();
+    struct stat fd_st, path_st;
+    while (1) {
+        flock(history_fd, LOCK_SH);
+        if (fstat(history_fd, &fd_st) == 0 && stat(history_path, &path_st) == 0 &&
+            fd_st.st_ino == path_st.st_ino && fd_st.st_dev == path_st.st_dev) {
+            break;
+        }
+        close(history_fd);  // Compacted behind our back: follow the new file
+        history_fd = open(history_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        if (history_fd < 0) {
+            perror("history");
+            return;
+        }
+    }
+
+    size_t off = 0;
+    while (off < history_pending_len) {
+        ssize_t n = write(history_fd, history_pending + off, history_pending_len - off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("history write");
+            break;
+        }
+        off += n;
+    }
+    if (history_sync == SYNC_FLUSH) fdatasync(history_fd);
+    flock(history_fd, LOCK_UN);
+
+    history_entries += history_pending_count;
+    history_pending_len = 0;
+    history_pending_count = 0;
+    TRACE_END("write_history", t);
+    if (history_entries > 2 * HISTORY_KEEP) history_compact();
+}
+
+// Milliseconds until buffered entries are due, or -1 if nothing is buffered
+int history_timeout() {
+    if (history_pending_count == 0) return -1;
+    long left = history_flush_ms - ms_since(&history_pending_since);
+    return left > 0 ? (int)left : 0;
+}
+
+// Flush entries that have waited too long
+int history_tick() {
+    if (history_pending_count > 0 && ms_since(&history_pending_since) >= history_flush_ms) {
+        history_flush();
+    }
+    return 0;
+}
+
+void history_close() {
+    if (history_fd < 0) return;
+    history_flush();
+    if (history_sync != SYNC_NONE) fdatasync(history_fd);
+    close(history_fd);
+    history_fd = -1;
+}
+
+// Rewrite the log with only its newest HISTORY_KEEP entries. The work is
+// done by a child process so the prompt is not delayed.
+void history_compact() {
+    history_entries = HISTORY_KEEP;
+    pid_t pid = fork();
+    if (pid != 0) {
+        if (pid == -1) perror("fork() failed for history compaction");
+        return;
+    }
+
+    int fd = open(history_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || flock(fd, LOCK_EX) != 0) _exit(1);
+    struct stat st;
+    if (fstat(fd, &st) != 0) _exit(1);
+    char *buf = malloc(st.st_size + 1);
+    size_t len = 0;
+    ssize_t n;
+    while (buf && len < (size_t)st.st_size && (n = read(fd, buf + len, st.st_size - len)) > 0) {
+        len += n;
+    }
+    if (!buf) _exit(1);
+
+    // Find the start of the HISTORY_KEEP-th line from the end
+    size_t start = len;
+    int lines = 0;
+    if (start > 0 && buf[start - 1] == '\n') start--;
+    while (start > 0) {
+        if (buf[start - 1] == '\n' && ++lines == HISTORY_KEEP) break;
+        start--;
+    }
+
+    char tmp_path[PATH_MAX + 32];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", history_path, getpid());
+    int out = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (out < 0) _exit(1);
+    if (write(out, buf + start, len - start) == (ssize_t)(len - start) && fsync(out) == 0) {
+        rename(tmp_path, history_path);
+    } else {
+        unlink(tmp_path);
+    }
+    close(out);
+    _exit(0);  // Exiting drops the lock on the old file
+}
+
+// Offset of the entry max entries before end (a line start or the end of
+// the map), stopping at the start of the map; *count gets how many it passed
+static size_t history_back(size_t end, long max, long *count) {
+    size_t pos = end;
+    long n = 0;
+    while (pos > 0 && n < max) {
+        const char *nl = pos > 1 ? memrchr(history_map, '\n', pos - 1) : NULL;
+        pos = nl ? (size_t)(nl - history_map) + 1 : 0;
+        n++;
+    }
+    *count = n;
+    return pos;
+}
+
+// Length of the entry starting at offset pos, without its newline
+static size_t history_entry_len(size_t pos) {
+    const char *nl = memchr(history_map + pos, '\n', history_map_len - pos);
+    return nl ? (size_t)(nl - history_map) - pos : history_map_len - pos;
+}
+
+// Up arrow / Ctrl-P: at the oldest entry readline has, load the window
+// before it from the map first
+static int history_up(int count, int key) {
+    int pos = where_history();
+    if (pos < count && history_loaded_start > 0) history_set_pos(pos + history_load_older());
+    return rl_get_previous_history(count, key);
+}
+
+// Map the log and give readline only its newest HISTORY_WINDOW entries,
+// so startup costs the same however large the file has grown
+void history_load() {
+    long long t = TRACE_BEGIN();
+    int fd = open(history_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            history_map = map;
+            history_map_len = st.st_size;
+        } else {
+            perror("history mmap");
+        }
+    }
+    if (fd >= 0) close(fd);
+
+    history_entries = 0;
+    history_loaded_start = 0;
+    if (history_map) {
+        // Counting stops once compaction is due, so this is bounded too
+        history_back(history_map_len, 2 * HISTORY_KEEP + 1, &history_entries);
+        history_loaded_start = history_map_len;
+        history_load_older();
+    }
+    if (history_loaded_start == 0) history_older = 0;
+
+    rl_initialize();  // Read inputrc first so these bindings win
+    rl_bind_keyseq("\\e[A", history_up);
+    rl_bind_keyseq("\\eOA", history_up);
+    rl_bind_keyseq("\\C-p", history_up);
+    TRACE_END("read_history", t);
+}
+
+// Put up to HISTORY_WINDOW entries from before the loaded ones at the
+// front of readline's list; returns how many were added
+int history_load_older() {
+    if (history_loaded_start == 0) return 0;
+    long n;
+    size_t start = history_back(history_loaded_start, HISTORY_WINDOW, &n);
+
+    // readline can only append, so build the new list and swap it in
+    HISTORY_STATE *state = history_get_history_state();
+    HIST_ENTRY **entries = malloc(sizeof(HIST_ENTRY *) * (n + state->length + 1));
+    if (!entries) {
+        free(state);
+        return 0;
+    }
+    long i = 0;
+    for (size_t pos = start; pos < history_loaded_start; i++) {
+        size_t len = history_entry_len(pos);
+        char *line = strndup(history_map + pos, len);
+        entries[i] = alloc_history_entry(line, NULL);
+        free(line);
+        pos += len + 1;
+    }
+    if (state->length > 0) memcpy(entries + n, state->entries, sizeof(HIST_ENTRY *) * state->length);
+    entries[n + state->length] = NULL;
+    free(state->entries);
+    state->entries = entries;
+    state->length += n;
+    state->size = state->length + 1;
+    state->offset += n;
+    history_set_history_state(state);
+    free(state);
+
+    history_loaded_start = start;
+    if (history_older >= 0) history_older -= n;
+    if (start == 0) history_older = 0;
+    return n;
+}
+
+// Index the start of every entry before the loaded window
+static int history_index() {
+    if (history_older >= 0) return 0;
+    size_t cap = 1024;
+    long n = 0;
+    size_t *offsets = malloc(sizeof(size_t) * cap);
+    for (size_t pos = 0; offsets && pos < history_loaded_start; n++) {
+        if ((size_t)n == cap) {
+            size_t *bigger = realloc(offsets, sizeof(size_t) * cap * 2);
+            if (!bigger) {
+                free(offsets);
+                offsets = NULL;
+                break;
+            }
+            offsets = bigger;
+            cap *= 2;
+        }
+        offsets[n] = pos;
+        pos += history_entry_len(pos) + 1;
+    }
+    if (!offsets) {
+        perror("history index");
+        return -1;
+    }
+    history_offsets = offsets;
+    history_older = n;
+    return 0;
+}
+
+// Copy of history entry n (1 is the oldest in the log), or NULL
+char *history_line(long n) {
+    if (n < 1 || history_index() != 0) return NULL;
+    if (n <= history_older) {
+        size_t pos = history_offsets[n - 1];
+        return strndup(history_map + pos, history_entry_len(pos));
+    }
+    HIST_ENTRY *entry = history_get(history_base + n - history_older - 1);
+    return entry ? strdup(entry->line) : NULL;
+}
+
+// Number of history entries, counting from the start of the log
+long history_total() {
+    if (history_index() != 0) return history_length;
+    return history_older + history_length;
+}
+
+// Text of entry n without copying it (not NUL-terminated)
+static const char *history_text(long n, size_t *len) {
+    if (n <= history_older) {
+        size_t pos = history_offsets[n - 1];
+        *len = history_entry_len(pos);
+        return history_map + pos;
+    }
+    HIST_ENTRY *entry = history_get(history_base + n - history_older - 1);
+    if (!entry) return NULL;
+    *len = strlen(entry->line);
+    return entry->line;
+}
+
+static Trigram *trigram_slot(unsigned key) {
+    size_t mask = trigram_cap - 1;
+    unsigned h = key * 2654435761u;
+    for (size_t i = (h ^ (h >> 15)) & mask;; i = (i + 1) & mask) {
+        if (trigrams[i].key == key || trigrams[i].key == 0) return &trigrams[i];
+    }
+}
+
+static int grow_trigrams() {
+    size_t old_cap = trigram_cap;
+    Trigram *old = trigrams;
+    trigram_cap = old_cap ? old_cap * 2 : TRIGRAM_TABLE_MIN;
+    trigrams = calloc(trigram_cap, sizeof(Trigram));
+    if (!trigrams) {
+        perror("calloc() failed for history index");
+        trigrams = old;
+        trigram_cap = old_cap;
+        return 0;
+    }
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].key) *trigram_slot(old[i].key) = old[i];
+    }
+    free(old);
+    return 1;
+}
+
+// Add entry n to the posting list of every trigram it contains
+void history_search_add(long n, const char *line, size_t len) {
+    unsigned key = 0x0101;
+    for (size_t i = 0; i < len; i++) {
+        key = ((key << 8) | (unsigned char)line[i]) & 0xffffff;
+        if (trigram_count * 2 >= trigram_cap && !grow_trigrams()) return;
+        Trigram *tg = trigram_slot(key);
+        if (tg->key == 0) {
+            tg->key = key;
+            trigram_count++;
+        }
+        if (tg->count > 0 && tg->ids[tg->count - 1] == (unsigned)n) continue;
+        if (tg->count == tg->cap) {
+            unsigned cap = tg->cap ? tg->cap * 2 : 4;
+            unsigned *bigger = realloc(tg->ids, sizeof(unsigned) * cap);
+            if (!bigger) {
+                perror("realloc() failed for history index");
+                return;
+            }
+            tg->ids = bigger;
+            tg->cap = cap;
+        }
+        tg->ids[tg->count++] = n;
+    }
+}
+
+static int history_search_build() {
+    if (trigrams) return 0;
+    if (history_index() != 0 || !grow_trigrams()) return -1;
+    long long t = TRACE_BEGIN();
+    long total = history_total();
+    for (long n = 1; n <= total; n++) {
+        size_t len;
+        const char *line = history_text(n, &len);
+        if (line) history_search_add(n, line, len);
+    }
+    TRACE_END("history_index", t);
+    return 0;
+}
+
+// Call match() on every entry before `before` that contains text (or
+// starts with it), newest first, until it returns nonzero. Candidates
+// come from the shortest posting list among the query's trigrams.
+static void history_matches(const char *text, int prefix, long before,
+                           int (*match)(long n, const char *line, size_t len, void *arg), void *arg) {
+    if (history_search_build() != 0) return;
+    size_t text_len = strlen(text);
+    Trigram *best = NULL;
+    unsigned key = prefix ? 0x0101 : 0;
+    for (size_t i = 0; i < text_len; i++) {
+        key = ((key << 8) | (unsigned char)text[i]) & 0xffffff;
+        if (!prefix && i < 2) continue;
+        Trigram *tg = trigram_slot(key);
+        if (tg->key == 0) return;  // No entry has this trigram
+        if (!best || tg->count < best->count) best = tg;
+    }
+
+    long i = best ? best->count : before - 1;
+    while (i-- > 0) {
+        long n = best ? (long)best->ids[i] : i + 1;
+        if (n >= before) continue;
+        size_t len;
+        const char *line = history_text(n, &len);
+        if (!line || len < text_len) continue;
+        if (prefix ? memcmp(line, text, text_len) != 0 : memmem(line, len, text, text_len) == NULL) continue;
+        if (match(n, line, len, arg)) return;
+    }
+}
+
+static int first_match(long n, const char *line, size_t len, void *arg) {
+    *(char **)arg = strndup(line, len);
+    return 1;
+}
+
+// Copy of the newest entry (other than the line being run) containing
+// text, or starting with it
+char *history_find(const char *text, int prefix) {
+    char *found = NULL;
+    history_matches(text, prefix, history_total(), first_match, &found);
+    return found;
+}
+
+// Distinct lines seen by `history search`, in an open-addressing table
+typedef struct {
+    SearchHit *hits;
+    size_t count, cap;
+    const char *text;
+    long seen;
+} SearchState;
+
+static SearchHit *hit_slot(SearchState *ss, const char *line, size_t len, unsigned hash) {
+    size_t mask = ss->cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        SearchHit *hit = &ss->hits[i];
+        if (!hit->line) return hit;
+        if (hit->hash == hash && hit->len == len && memcmp(hit->line, line, len) == 0) return hit;
+    }
+}
+
+static int grow_hits(SearchState *ss) {
+    size_t old_cap = ss->cap;
+    SearchHit *old = ss->hits;
+    ss->cap = old_cap ? old_cap * 2 : 256;
+    ss->hits = calloc(ss->cap, sizeof(SearchHit));
+    if (!ss->hits) {
+        perror("calloc() failed for history search");
+        ss->hits = old;
+        ss->cap = old_cap;
+        return 0;
+    }
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].line) *hit_slot(ss, old[i].line, old[i].len, old[i].hash) = old[i];
+    }
+    free(old);
+    return 1;
+}
+
+static int collect_match(long n, const char *line, size_t len, void *arg) {
+    SearchState *ss = arg;
+    if (ss->count * 2 >= ss->cap && !grow_hits(ss)) return 1;
+    unsigned hash = hash_bytes(line, len);
+    SearchHit *hit = hit_slot(ss, line, len, hash);
+    if (!hit->line) {
+        hit->line = line;
+        hit->len = len;
+        hit->hash = hash;
+        hit->newest = n;  // Matches arrive newest first
+        hit->prefix = strncmp(line, ss->text, strlen(ss->text)) == 0;
+        ss->count++;
+    }
+    hit->count++;
+    return ++ss->seen >= HISTORY_SEARCH_SCAN;
+}
+
+// Prefix matches first, then the most used, then the most recent
+static int compare_hits(const void *a, const void *b) {
+    const SearchHit *x = a, *y = b;
+    if (x->prefix != y->prefix) return y->prefix - x->prefix;
+    if (x->count != y->count) return y->count - x->count;
+    return (y->newest > x->newest) - (y->newest < x->newest);
+}
+
+// `history search`: distinct matching commands, best first
+int history_search_print(const char *text) {
+    SearchState ss = {NULL, 0, 0, text, 0};
+    if (!grow_hits(&ss)) return 1;
+    history_matches(text, 0, history_total(), collect_match, &ss);
+
+    // Pack the table, then rank
+    size_t n = 0;
+    for (size_t i = 0; i < ss.cap; i++) {
+        if (ss.hits[i].line) ss.hits[n++] = ss.hits[i];
+    }
+    qsort(ss.hits, n, sizeof(SearchHit), compare_hits);
+    for (size_t i = 0; i < n && i < HISTORY_SEARCH_MAX; i++) {
+        SearchHit *hit = &ss.hits[i];
+        printf("%6ld  %.*s", hit->newest, (int)hit->len, hit->line);
+        if (hit->count > 1) printf("  (x%d)", hit->count);
+        printf("\n");
+    }
+    free(ss.hits);
+    return n > 0 ? 0 : 1;
+}
+
+// Refresh the cached working directory; only `cd` changes it
+void update_cwd() {
+    if (getcwd(shell_cwd, sizeof(shell_cwd)) == NULL) {
+        perror("getcwd() error");
+        strcpy(shell_cwd, "unknown");
+    }
+}
+
+void display_prompt(char *prompt) {
+    char segments[3 * (PROMPT_SEGMENT_MAX + 3) + 1];
+    size_t len = 0;
+    segments[0] = '\0';
+    for (int i = 0; i < NUM_SEGMENTS; i++) {
+        PromptSegment *seg = &prompt_segments[i];
+        if (!*seg->option) continue;
+        if (seg->fast) seg->fast(seg);
+        if (seg->value[0] == '\0' || (seg->per_dir && strcmp(seg->dir, shell_cwd) != 0)) continue;
+        len += snprintf(segments + len, sizeof(segments) - len, "-(%s)", seg->value);
+        if (len >= sizeof(segments)) len = sizeof(segments) - 1;
+    }
+    int n = snprintf(prompt, PROMPT_MAX, "\n-(%s)-[%s]%s\n---$ ", PROMPT, shell_cwd, segments);
+    prompt_header_len = n - (int)strlen("\n\n---$ ");
+}
+
+static void segment_took(PromptSegment *seg) {
+    seg->value[0] = '\0';
+    if (last_command_ms >= prompt_took_ms) {
+        snprintf(seg->value, sizeof(seg->value), "took %.1fs", last_command_ms / 1000.0);
+    }
+}
+
+// Branch from .git/HEAD as a first guess, then the answer: with a `*` if
+// `git status` lists changes. Outside a repository the value is empty.
+static void segment_vcs(int index, int fd) {
+    char path[PATH_MAX + 32], head[256];
+    size_t len = strlen(shell_cwd);
+    struct stat sb;
+    while (1) {  // Look for .git from the working directory up
+        snprintf(path, sizeof(path), "%.*s/.git", (int)len, shell_cwd);
+        if (stat(path, &sb) == 0) break;
+        const char *slash = len > 0 ? memrchr(shell_cwd, '/', len) : NULL;
+        if (slash == NULL) {
+            dprintf(fd, "%d\t\n", index);
+            return;
+        }
+        len = slash - shell_cwd;
+    }
+
+    if (S_ISREG(sb.st_mode)) {  // Worktrees and submodules: "gitdir: <path>"
+        FILE *fp = fopen(path, "r");
+        char *gitdir = fp && fgets(head, sizeof(head), fp) ? head + 8 : NULL;
+        if (fp) fclose(fp);
+        if (gitdir == NULL || strncmp(head, "gitdir: ", 8) != 0) return;
+        gitdir[strcspn(gitdir, "\n")] = '\0';
+        if (gitdir[0] == '/') {
+            snprintf(path, sizeof(path), "%s/HEAD", gitdir);
+        } else {
+            snprintf(path, sizeof(path), "%.*s/%s/HEAD", (int)len, shell_cwd, gitdir);
+        }
+    } else {
+        strcat(path, "/HEAD");
+    }
+    int head_fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n = head_fd >= 0 ? read(head_fd, head, sizeof(head) - 1) : -1;
+    if (head_fd >= 0) close(head_fd);
+    if (n <= 0) return;
+    head[n] = '\0';
+    head[strcspn(head, "\n")] = '\0';
+    const char *branch = head;
+    if (strncmp(head, "ref: refs/heads/", 16) == 0) {
+        branch = head + 16;
+    } else if (n > 7) {
+        head[7] = '\0';  // Detached: a short commit id
+    }
+    dprintf(fd, "%d~%s\n", index, branch);
+
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) != 0) return;
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, STDIN_FILENO);
+        dup2(pipefd[1], STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execlp("git", "git", "--no-optional-locks", "status", "--porcelain", "--untracked-files=no", (char *)NULL);
+        _exit(127);
+    }
+    close(pipefd[1]);
+    char c;
+    int changed = pid > 0 && read(pipefd[0], &c, 1) == 1;  // One line is enough
+    close(pipefd[0]);
+    int status = 0;
+    if (pid > 0) waitpid(pid, &status, 0);
+    dprintf(fd, "%d\t%s%s\n", index, branch, changed && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? "*" : "");
+}
+
+static void segment_load(int index, int fd) {
+    double load;
+    if (getloadavg(&load, 1) == 1) {
+        dprintf(fd, "%d\tload %.2f\n", index, load);
+    } else {
+        dprintf(fd, "%d\t\n", index);
+    }
+}
+
+// Whether the worker should compute seg. Outside a repository nothing is
+// forked for the vcs segment before PROMPT_RECHECK_MS have passed.
+static int segment_due(PromptSegment *seg) {
+    if (!seg->slow || !*seg->option) return 0;
+    return seg->value[0] || strcmp(seg->dir, shell_cwd) != 0 || ms_since(&seg->updated) >= PROMPT_RECHECK_MS;
+}
+
+// Fork a worker for the enabled slow segments, unless one is still running
+void prompt_worker_start() {
+    int wanted = 0;
+    for (int i = 0; i < NUM_SEGMENTS; i++) {
+        if (segment_due(&prompt_segments[i])) wanted = 1;
+    }
+    if (!wanted || prompt_worker_fd >= 0 || event_ep < 0) return;
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        perror("pipe() failed for prompt worker");
+        return;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        setpgid(0, 0);  // A group of its own, so the deadline also stops `git`
+        sigprocmask(SIG_SETMASK, &orig_sigmask, NULL);
+        signal(SIGINT, SIG_DFL);
+        for (int i = 0; i < NUM_SEGMENTS; i++) {
+            if (segment_due(&prompt_segments[i])) prompt_segments[i].slow(i, fds[1]);
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    if (pid == -1) {
+        perror("fork() failed for prompt worker");
+        close(fds[0]);
+        return;
+    }
+    setpgid(pid, pid);
+    prompt_worker = pid;
+    prompt_worker_fd = fds[0];
+    prompt_worker_len = 0;
+    strcpy(prompt_worker_dir, shell_cwd);
+    clock_gettime(CLOCK_MONOTONIC, &prompt_worker_since);
+    struct epoll_event ev = {.events = EPOLLIN};
+    ev.data.fd = prompt_worker_fd;
+    epoll_ctl(event_ep, EPOLL_CTL_ADD, prompt_worker_fd, &ev);
+}
+
+static void prompt_worker_stop() {
+    epoll_ctl(event_ep, EPOLL_CTL_DEL, prompt_worker_fd, NULL);
+    close(prompt_worker_fd);
+    prompt_worker_fd = -1;
+}
+
+// Redraw the prompt in place after a segment changed while it is shown:
+// clear the input line, go up over the prompt's first two lines and let
+// readline print it all again with what was typed so far
+static void prompt_redraw() {
+    if (!prompt_active || compound_pending()) return;
+    char old[PROMPT_MAX];
+    int old_len = prompt_header_len;
+    strcpy(old, prompt);
+    display_prompt(prompt);
+    if (strcmp(old, prompt) == 0) return;
+
+    int rows, cols;
+    rl_get_screen_size(&rows, &cols);
+    int up = 2 + (cols > 0 && old_len > 0 ? (old_len - 1) / cols : 0);
+    rl_clear_visible_line();
+    printf("\033[%dA\r\033[J", up);
+    fflush(stdout);
+    rl_set_prompt(prompt);
+    rl_forced_update_display();
+}
+
+// Apply the lines the worker has written so far; EOF means it is done
+void prompt_worker_read() {
+    size_t room = sizeof(prompt_worker_buf) - 1 - prompt_worker_len;
+    ssize_t n = read(prompt_worker_fd, prompt_worker_buf + prompt_worker_len, room);
+    if (n < 0 && errno == EINTR) return;
+    if (n > 0) {
+        prompt_worker_len += n;
+        char *line = prompt_worker_buf;
+        char *nl;
+        while ((nl = memchr(line, '\n', prompt_worker_buf + prompt_worker_len - line)) != NULL) {
+            *nl = '\0';
+            char *sep = line + strspn(line, "0123456789");
+            int index = atoi(line);
+            PromptSegment *seg = index < NUM_SEGMENTS ? &prompt_segments[index] : NULL;
+            int known = seg && seg->value[0] && strcmp(seg->dir, prompt_worker_dir) == 0;
+            if (seg && (*sep == '\t' || (*sep == '~' && !known))) {
+                snprintf(seg->value, sizeof(seg->value), "%s", sep + 1);
+                strcpy(seg->dir, prompt_worker_dir);
+                clock_gettime(CLOCK_MONOTONIC, &seg->updated);
+            }
+            line = nl + 1;
+        }
+        prompt_worker_len -= line - prompt_worker_buf;
+        memmove(prompt_worker_buf, line, prompt_worker_len);
+        prompt_redraw();
+    }
+    if (n <= 0 || (size_t)n == room) prompt_worker_stop();
+}
+
+// Milliseconds until the worker's deadline, or -1 if none is running
+int prompt_timeout() {
+    if (prompt_worker_fd < 0) return -1;
+    long left = prompt_timeout_ms - ms_since(&prompt_worker_since);
+    return left > 0 ? (int)left : 0;
+}
+
+// Give up on a worker past its deadline; the old values stay
+void prompt_tick() {
+    if (prompt_worker_fd < 0 || prompt_timeout() > 0) return;
+    if (prompt_worker) kill(-prompt_worker, SIGKILL);
+    prompt_worker_stop();
+}
+
+// Return the slot holding name, or the empty slot where it would go
+static Var *var_slot(const char *name, size_t len, unsigned hash) {
+    size_t mask = var_cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        Var *v = &vars[i];
+        if (v->name == NULL) return v;
+        if (v->hash == hash && v->name_len == len && memcmp(v->name, name, len) == 0) return v;
+    }
+}
+
+static int grow_vars() {
+    size_t old_cap = var_cap;
+    Var *old = vars;
+    var_cap = old_cap ? old_cap * 2 : VAR_TABLE_MIN;
+    vars = calloc(var_cap, sizeof(Var));
+    if (!vars) {
+        perror("calloc() failed for variables");
+        vars = old;
+        var_cap = old_cap;
+        return 0;
+    }
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].name) *var_slot(old[i].name, old[i].name_len, old[i].hash) = old[i];
+    }
+    free(old);
+    return 1;
+}
+
+// Make the environment visible through the table without copying it;
+// entries are only duplicated once they are changed
+void import_environment() {
+    for (char **env = environ; *env != NULL; env++) {
+        const char *eq = strchr(*env, '=');
+        if (!eq) continue;
+        size_t len = eq - *env;
+        unsigned hash = hash_bytes(*env, len);
+        if ((var_count + 1) * 10 > var_cap * 7 && !grow_vars()) return;
+        Var *v = var_slot(*env, len, hash);
+        if (v->name) continue;  // Duplicate entry: getenv() uses the first
+        v->name = *env;
+        v->value = eq + 1;
+        v->hash = hash;
+        v->name_len = len;
+        v->flags = VAR_GLOBAL | VAR_BORROWED;
+        var_count++;
+    }
+}
+
+Var *find_var(const char *name, size_t len) {
+    if (var_count == 0) return NULL;
+    Var *v = var_slot(name, len, hash_bytes(name, len));
+    return v->name ? v : NULL;
+}
+
+// Function to set a variable (local or global). A variable that is
+// already exported stays exported.
+int set_var(const char *name, const char *value, int global) {
+    if ((var_count + 1) * 10 > var_cap * 7 && !grow_vars()) return 0;
+
+    size_t len = strlen(name);
+    unsigned hash = hash_bytes(name, len);
+    Var *v = var_slot(name, len, hash);
+    char *new_value = strdup(value);
+    if (!new_value) {
+        perror("strdup() failed for variable");
+        return 0;
+    }
+
+    if (v->name == NULL) {  // Add new variable
+        v->name = strdup(name);
+        if (!v->name) {
+            perror("strdup() failed for variable");
+            free(new_value);
+            return 0;
+        }
+        v->hash = hash;
+        v->name_len = len;
+        v->flags = 0;
+        var_count++;
+    } else if (v->flags & VAR_BORROWED) {
+        char *own_name = strndup(v->name, len);
+        if (!own_name) {  // The entry keeps pointing into environ
+            perror("strndup() failed for variable");
+            free(new_value);
+            return 0;
+        }
+        v->name = own_name;
+        v->flags &= ~VAR_BORROWED;
+    } else {
+        free((char *)v->value);
+    }
+    v->value = new_value;
+    v->flags |= VAR_SHELL | (global ? VAR_GLOBAL : 0);
+
+    if (v->flags & VAR_GLOBAL) {
+        setenv(name, value, 1);  // Update environment variable
+        if (strcmp(name, "PATH") == 0) {
+            hash_clear();
+            command_index_clear();
+        }
+    }
+    return 1;
+}
+
+// Delete a variable; returns 0 if it did not exist
+int remove_var(const char *name) {
+    Var *v = find_var(name, strlen(name));
+    if (!v) return 0;
+
+    if (v->flags & VAR_GLOBAL) {
+        unsetenv(name);
+        if (strcmp(name, "PATH") == 0) {
+            hash_clear();
+            command_index_clear();
+        }
+    }
+    if (!(v->flags & VAR_BORROWED)) {
+        free((char *)v->name);
+        free((char *)v->value);
+    }
+
+    // Backward-shift deletion keeps every probe chain intact without tombstones
+    size_t mask = var_cap - 1;
+    size_t hole = v - vars;
+    for (size_t i = (hole + 1) & mask; vars[i].name != NULL; i = (i + 1) & mask) {
+        size_t home = vars[i].hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            vars[hole] = vars[i];
+            hole = i;
+        }
+    }
+    vars[hole].name = NULL;
+    var_count--;
+    return 1;
+}
+
+// Function to unset a variable
+void unset_var(const char *name) {
+    if (remove_var(name)) {
+        printf("Variable %s unset.\n", name);
+    } else {
+        printf("Variable %s not found.\n", name);
+    }
+}
+
+// PIPESTATUS and PIPETIMES live outside the table: they change after
+// every pipeline and are not variables the user set
+static const char *pipe_var(const char *name, size_t len) {
+    if (len == 10 && memcmp(name, "PIPESTATUS", 10) == 0) return pipe_status_text;
+    if (len == 9 && memcmp(name, "PIPETIMES", 9) == 0) return pipe_times_text;
+    return NULL;
+}
+
+// Function to get the value of a variable
+const char *get_var(const char *name) {
+    size_t len = strlen(name);
+    const char *value = pipe_var(name, len);
+    if (value) return value;
+    Var *v = find_var(name, len);
+    return v ? v->value : NULL;
+}
+
+static int compare_vars(const void *a, const void *b) {
+    const Var *x = *(const Var **)a, *y = *(const Var **)b;
+    size_t len = x->name_len < y->name_len ? x->name_len : y->name_len;
+    int cmp = memcmp(x->name, y->name, len);
+    return cmp ? cmp : (int)x->name_len - (int)y->name_len;
+}
+
+// Function to list variables set in the shell, or all of them (list -a)
+void list_vars(int all) {
+    size_t shown = 0;
+    Var **sorted = malloc(sizeof(Var *) * (var_count + 1));
+    if (!sorted) {
+        perror("malloc() failed for variable list");
+        return;
+    }
+    for (size_t i = 0; i < var_cap; i++) {
+        if (vars[i].name && (all || (vars[i].flags & VAR_SHELL))) sorted[shown++] = &vars[i];
+    }
+
+    if (shown == 0) {
+        printf("No variables to Display!");
+    } else {
+        qsort(sorted, shown, sizeof(Var *), compare_vars);
+        printf("Local and environment variables:\n");
+        for (size_t i = 0; i < shown; i++) {
+            printf("%.*s=%s (%s)\n", (int)sorted[i]->name_len, sorted[i]->name, sorted[i]->value,
+                   (sorted[i]->flags & VAR_GLOBAL) ? "global" : "local");
+        }
+    }
+    free(sorted);
+}
+
+static int expand_put(const char *str, size_t len) {
+    if (expand_len + len + 1 > expand_cap) {
+        size_t cap = expand_cap ? expand_cap : 256;
+        while (cap < expand_len + len + 1) cap *= 2;
+        char *bigger = realloc(expand_buf, cap);
+        if (!bigger) {
+            perror("realloc() failed for expansion");
+            return 0;
+        }
+        expand_buf = bigger;
+        expand_cap = cap;
+    }
+    memcpy(expand_buf + expand_len, str, len);
+    expand_len += len;
+    return 1;
+}
+
+static int is_name_char(char c) {
+    return c == '_' || isalnum((unsigned char)c);
+}
+
+// Length of the name or special parameter at the start of str[0..len)
+static size_t name_length(const char *str, size_t len) {
+    if (len > 0 && (str[0] == '?' || str[0] == '$' || str[0] == '!')) return 1;
+    if (len == 0 || !(str[0] == '_' || isalpha((unsigned char)str[0]))) return 0;
+    size_t n = 1;
+    while (n < len && is_name_char(str[n])) n++;
+    return n;
+}
+
+// Value of a name or special parameter, or NULL if it is unset
+static const char *lookup_name(const char *name, size_t len, char *num, size_t num_size) {
+    if (len == 1 && (name[0] == '?' || name[0] == '$' || name[0] == '!')) {
+        if (name[0] == '$' && !shell_pid) shell_pid = getpid();
+        long value = name[0] == '?' ? last_status : name[0] == '$' ? shell_pid : last_background_pid;
+        if (name[0] == '!' && !value) return NULL;
+        snprintf(num, num_size, "%ld", value);
+        return num;
+    }
+    const char *value = pipe_var(name, len);
+    if (value) return value;
+    Var *v = find_var(name, len);  // The only lookup of this reference
+    return v ? v->value : NULL;
+}
+
+static void expand_into(const char *src, size_t len);
+
+// Expand the inside of ${...}: NAME, NAME:-word or NAME:=word
+static void expand_braces(const char *src, size_t len) {
+    char num[24];
+    size_t name_len = name_length(src, len);
+    const char *value = name_len ? lookup_name(src, name_len, num, sizeof(num)) : NULL;
+    if (name_len > 0 && name_len == len) {
+        if (value) expand_put(value, strlen(value));
+        return;
+    }
+    if (name_len == 0 || len - name_len < 2 || src[name_len] != ':' ||
+        (src[name_len + 1] != '-' && src[name_len + 1] != '=')) {
+        fprintf(stderr, "${%.*s}: bad substitution\n", (int)len, src);
+        return;
+    }
+    if (value && *value) {
+        expand_put(value, strlen(value));
+        return;
+    }
+
+    // Unset or empty: use the word, expanded in turn
+    const char *word = src + name_len + 2;
+    size_t start = expand_len;
+    expand_into(word, len - name_len - 2);
+    if (src[name_len + 1] == '=' && src[0] != '?' && src[0] != '$' && src[0] != '!') {
+        char *name = arena_alloc(&cmd_arena, name_len + 1);
+        if (name && expand_put("", 0)) {
+            memcpy(name, src, name_len);
+            name[name_len] = '\0';
+            expand_buf[expand_len] = '\0';
+            set_var(name, expand_buf + start, 0);
+        }
+    }
+}
+
+// Append the expansion of src[0..len) to expand_buf in one left-to-right pass
+static void expand_into(const char *src, size_t len) {
+    const char *end = src + len;
+    char num[24];
+    while (src < end) {
+        const char *dollar = memchr(src, '$', end - src);
+        if (!dollar) {
+            expand_put(src, end - src);
+            return;
+        }
+        expand_put(src, dollar - src);
+        src = dollar + 1;
+
+        size_t name_len = name_length(src, end - src);
+        if (name_len > 0) {  // $NAME, $?, $$, $!
+            const char *value = lookup_name(src, name_len, num, sizeof(num));
+            if (value) expand_put(value, strlen(value));
+            src += name_len;
+        } else if (src < end && *src == '{') {
+            // Find the matching brace; defaults may contain ${...} too
+            const char *cp = src + 1;
+            int depth = 1;
+            while (cp < end) {
+                if (*cp == '$' && cp + 1 < end && cp[1] == '{') {
+                    depth++;
+                    cp++;
+                } else if (*cp == '}' && --depth == 0) {
+                    break;
+                }
+                cp++;
+            }
+            if (cp == end) {  // Unterminated: keep it as it is
+                expand_put(dollar, end - dollar);
+                return;
+            }
+            expand_braces(src + 1, cp - src - 1);
+            src = cp + 1;
+        } else {
+            expand_put("$", 1);  // A lone `$` stands for itself
+        }
+    }
+}
+
+// Expand $NAME, ${NAME}, ${NAME:-word}, ${NAME:=word}, $?, $$ and $!
+// anywhere in each word. Expanded words are written to the command's
+// arena; words that expand to nothing are dropped, as unset variables
+// leave no argument behind.
+void expand_variables(char **arglist) {
+    int out = 0;
+    for (int i = 0; arglist[i] != NULL; i++) {
+        char *word = arglist[i];
+        if (!strchr(word, '$')) {
+            arglist[out++] = word;
+            continue;
+        }
+        expand_len = 0;
+        expand_into(word, strlen(word));
+        if (expand_len == 0) continue;
+        char *copy = arena_alloc(&cmd_arena, expand_len + 1);
+        if (!copy) {
+            arglist[out++] = word;
+            continue;
+        }
+        memcpy(copy, expand_buf, expand_len);
+        copy[expand_len] = '\0';
+        arglist[out++] = copy;
+    }
+    arglist[out] = NULL;
+}
+
+// Expand a single word, such as a redirection target, into the arena
+const char *expand_word(const char *word) {
+    if (!strchr(word, '$')) return word;
+    expand_len = 0;
+    expand_into(word, strlen(word));
+    char *copy = arena_alloc(&cmd_arena, expand_len + 1);
+    if (!copy) return word;
+    memcpy(copy, expand_buf, expand_len);
+    copy[expand_len] = '\0';
+    return copy;
+}
+
+// Built-in commands. Each handler returns the command's exit status.
+
+int builtin_cd(char *arglist[]) {
+    if (arglist[1] == NULL) {
+        fprintf(stderr, "cd: missing operand\n");
+        return 1;
+    } else if (chdir(arglist[1]) != 0) {
+        perror("cd");
+        return 1;
+    }
+    update_cwd();
+    return 0;
+}
+
+int builtin_exit(char *arglist[]) {
+    printf("Exit Successfully!\n");
+    exit(0);
+}
+
+int builtin_set(char *arglist[]) {
+    if (arglist[1] && arglist[2]) {
+        return !set_var(arglist[1], arglist[2], 0);  // Set local variable
+    }
+    printf("Usage: set <variable> <value>\n");
+    return 2;
+}
+
+int builtin_unset(char *arglist[]) {
+    if (arglist[1] == NULL) {
+        fprintf(stderr, "unset: missing variable name\n");
+        return 2;
+    }
+    unset_var(arglist[1]);
+    return 0;
+}
+
+int builtin_export(char *arglist[]) {
+    if (arglist[1] && arglist[2]) {
+        return !set_var(arglist[1], arglist[2], 1);  // Set global (environment) variable
+    }
+    printf("Usage: export <variable> <value>\n");
+    return 2;
+}
+
+int builtin_get(char *arglist[]) {
+    if (arglist[1] == NULL) {
+        printf("Usage: get <variable>\n");
+        return 2;
+    }
+    const char *value = get_var(arglist[1]);
+    if (value) {
+        printf("%s=%s\n", arglist[1], value);
+        return 0;
+    }
+    printf("%s not found.\n", arglist[1]);
+    return 1;
+}
+
+int builtin_list(char *arglist[]) {
+    list_vars(arglist[1] && strcmp(arglist[1], "-a") == 0);
+    return 0;
+}
+
+int builtin_history(char *arglist[]) {
+    if (arglist[1] && strcmp(arglist[1], "search") == 0) {
+        if (arglist[2] == NULL) {
+            printf("Usage: history search <text>\n");
+            return 2;
+        }
+        // The query is the rest of the words, joined by single spaces
+        size_t size = 1;
+        for (int i = 2; arglist[i]; i++) size += strlen(arglist[i]) + 1;
+        char *text = arena_alloc(&cmd_arena, size);
+        if (!text) return 1;
+        text[0] = '\0';
+        for (int i = 2; arglist[i]; i++) {
+            if (i > 2) strcat(text, " ");
+            strcat(text, arglist[i]);
+        }
+        return history_search_print(text);
+    }
+
+    long count = arglist[1] ? atol(arglist[1]) : HISTORY_SEARCH_MAX;
+    long total = history_total();
+    for (long n = count < total ? total - count + 1 : 1; n <= total; n++) {
+        char *line = history_line(n);
+        if (line) printf("%6ld  %s\n", n, line);
+        free(line);
+    }
+    return 0;
+}
+
+int builtin_parsecache(char *arglist[]) {
+    if (arglist[1] && strcmp(arglist[1], "-r") == 0) {
+        parse_cache_clear();
+        parse_hits = parse_misses = parse_evictions = 0;
+        return 0;
+    }
+    unsigned long lookups = parse_hits + parse_misses;
+    printf("entries %d/%d, hits %lu, misses %lu (%.1f%% hit), evictions %lu\n",
+           parse_cache_count, parse_cache_max, parse_hits, parse_misses,
+           lookups ? 100.0 * parse_hits / lookups : 0.0, parse_evictions);
+    return 0;
+}
+
+int builtin_jobs(char *arglist[]) {
+    if (are_jobs_present()) {  // Check for job presence
+        list_jobs();  // List the jobs if present
+        return 0;
+    }
+    printf("No jobs Found.\n");
+    return 1;
+}
+
+int builtin_kill(char *arglist[]) {
+    if (arglist[1] == NULL || (arglist[1][0] == '-' && arglist[2] == NULL)) {
+        fprintf(stderr, "Usage: kill [-signal] <job ID or PID>\n");
+        return 2;
+    }
+    int signal = SIGKILL;  // Default signal is SIGKILL
+    int target_pid = -1;   // PID to kill
+    int job_id = -1;       // Initialize job ID as -1 (not found)
+
+    // Check if a signal is provided (e.g., kill -9 <job_id/PID>)
+    if (arglist[1][0] == '-') {
+        signal = atoi(arglist[1] + 1);
+        if (arglist[2]) job_id = atoi(arglist[2]);  // Job ID or PID as the next argument
+    } else {
+        job_id = atoi(arglist[1]);  // Treat arglist[1] as job ID or PID
+    }
+
+    // Attempt to find the PID by job ID first
+    Job *job = find_job(job_id);
+    if (job) {
+        target_pid = job->pid;  // Retrieve PID from job ID
+    } else {
+        target_pid = job_id;  // If no job match, assume it's a PID
+    }
+
+    // Kill the process using the target PID, or the job's whole pipeline.
+    // The job leaves the table once its processes have been reaped.
+    if (target_pid <= 0 || kill(job ? -job->pgid : target_pid, signal) != 0) {
+        perror("kill");
+        return 1;
+    }
+    printf("Killed %s [%d] %d\n", (job ? "job" : "process"), job_id, target_pid);
+    return 0;
+}
+
+int builtin_hash(char *arglist[]) {
+    int status = 0;
+    if (arglist[1] == NULL) {
+        hash_list();
+    } else if (strcmp(arglist[1], "-r") == 0) {
+        hash_clear();
+    } else {
+        for (int i = 1; arglist[i] != NULL; i++) {
+            if (hash_command(arglist[i]) == NULL) {
+                fprintf(stderr, "hash: %s: not found\n", arglist[i]);
+                status = 1;
+            }
+        }
+    }
+    return status;
+}
+
+int builtin_shopt(char *arglist[]) {
+    if (arglist[1] == NULL) {
+        list_options();
+        return 0;
+    } else if (arglist[2] == NULL) {
+        printf("Usage: shopt <option> <value>\n");
+        return 2;
+    }
+    return !set_option(arglist[1], arglist[2]);
+}
+
+int builtin_trace(char *arglist[]) {
+    if (!trace_events) {
+        printf("trace: tracing is off (set %s to an output file)\n", TRACE_ENV);
+        return 1;
+    }
+    return trace_write(arglist[1] ? arglist[1] : trace_path) == 0 ? 0 : 1;
+}
+
+// Print the escape sequence that follows a backslash and return the text
+// after it; \c sets *stop, which ends all output
+static const char *print_escape(const char *p, int *stop) {
+    static const char from[] = "abefnrtv\\", to[] = "\a\b\033\f\n\r\t\v\\";
+    const char *hit = *p ? strchr(from, *p) : NULL;
+    if (hit) {
+        putchar(to[hit - from]);
+        return p + 1;
+    }
+    if (*p == 'c') {
+        *stop = 1;
+        return p + 1;
+    }
+    if (*p >= '0' && *p <= '7') {  // \nnn, or echo's \0nnn
+        int c = 0;
+        for (int n = *p == '0' ? 4 : 3; n > 0 && *p >= '0' && *p <= '7'; n--) c = c * 8 + (*p++ - '0');
+        putchar(c);
+        return p;
+    }
+    if (*p == 'x' && isxdigit((unsigned char)p[1])) {
+        int c = 0;
+        for (int n = 2; n > 0 && isxdigit((unsigned char)*++p); n--) {
+            c = c * 16 + (isdigit((unsigned char)*p) ? *p - '0' : tolower((unsigned char)*p) - 'a' + 10);
+        }
+        putchar(c);
+        return p;
+    }
+    putchar('\\');  // Not an escape: keep it as written
+    return p;
+}
+
+// Print str with its backslash escapes interpreted; returns 1 after \c
+static int print_escaped(const char *str, int *stop) {
+    while (*str && !*stop) {
+        if (*str == '\\') {
+            str = print_escape(str + 1, stop);
+        } else {
+            putchar(*str++);
+        }
+    }
+    return *stop;
+}
+
+int builtin_echo(char *arglist[]) {
+    int newline = 1, escapes = 0, stop = 0;
+    int i = 1;
+    for (; arglist[i] && arglist[i][0] == '-' && arglist[i][1]; i++) {
+        const char *opt = arglist[i] + 1;
+        if (opt[strspn(opt, "ne")] != '\0') break;  // Not an option: print it
+        if (strchr(opt, 'n')) newline = 0;
+        if (strchr(opt, 'e')) escapes = 1;
+    }
+    for (int first = i; arglist[i]; i++) {
+        if (i > first) putchar(' ');
+        if (!escapes) {
+            fputs(arglist[i], stdout);
+        } else if (print_escaped(arglist[i], &stop)) {
+            return 0;  // \c: no newline either
+        }
+    }
+    if (newline) putchar('\n');
+    return 0;
+}
+
+// Numeric printf argument: a number in C syntax, or 'c for a character code
+static long long printf_number(const char *arg, int *status) {
+    if (arg == NULL || *arg == '\0') return 0;
+    if (*arg == '\'' || *arg == '"') return (unsigned char)arg[1];
+    char *end;
+    errno = 0;
+    long long value = strtoll(arg, &end, 0);
+    if (*end != '\0' || errno) {
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        *status = 1;
+    }
+    return value;
+}
+
+// Reuses the format until every argument has been consumed, like POSIX printf
+int builtin_printf(char *arglist[]) {
+    if (arglist[1] == NULL) {
+        fprintf(stderr, "Usage: printf <format> [arguments...]\n");
+        return 2;
+    }
+    char **args = arglist + 2;
+    int status = 0, stop = 0;
+    char **before;
+    do {
+        before = args;
+        const char *p = arglist[1];
+        while (*p && !stop) {
+            if (*p == '\\') {
+                p = print_escape(p + 1, &stop);
+                continue;
+            } else if (*p != '%') {
+                putchar(*p++);
+                continue;
+            } else if (p[1] == '%') {
+                putchar('%');
+                p += 2;
+                continue;
+            }
+
+            // Flags, width and precision are passed on to printf(3)
+            size_t len = 1 + strspn(p + 1, "-+ #0");
+            len += strspn(p + len, "0123456789");
+            if (p[len] == '.') len += 1 + strspn(p + len + 1, "0123456789");
+            char conv = p[len];
+            char spec[32];
+            if (conv == '\0' || !strchr("diouxXeEfgGcsb", conv) || len + 3 > sizeof(spec)) {
+                fprintf(stderr, "printf: invalid format `%.*s'\n", (int)len + (conv != '\0'), p);
+                return 1;
+            }
+            memcpy(spec, p, len);
+            p += len + 1;
+            const char *arg = *args ? *args++ : NULL;
+            switch (conv) {
+            case 'd': case 'i':
+                strcpy(spec + len, "lld");
+                printf(spec, printf_number(arg, &status));
+                break;
+            case 'o': case 'u': case 'x': case 'X':
+                spec[len] = spec[len + 1] = 'l';
+                spec[len + 2] = conv;
+                spec[len + 3] = '\0';
+                printf(spec, (unsigned long long)printf_number(arg, &status));
+                break;
+            case 'e': case 'E': case 'f': case 'g': case 'G':
+                spec[len] = conv;
+                spec[len + 1] = '\0';
+                printf(spec, arg ? strtod(arg, NULL) : 0.0);
+                break;
+            case 'c':
+                strcpy(spec + len, ".1s");  // First character, or nothing
+                printf(spec, arg ? arg : "");
+                break;
+            case 's':
+                strcpy(spec + len, "s");
+                printf(spec, arg ? arg : "");
+                break;
+            case 'b':
+                if (arg) print_escaped(arg, &stop);
+                break;
+            }
+        }
+    } while (*args && args != before && !stop);
+    return status;
+}
+
+static int test_or(TestExpr *e);
+
+static int test_integer(TestExpr *e, const char *str, long long *value) {
+    char *end;
+    errno = 0;
+    *value = strtoll(str, &end, 10);
+    if (*str == '\0' || *end != '\0' || errno) {
+        fprintf(stderr, "test: %s: integer expression expected\n", str);
+        e->error = 1;
+        return 0;
+    }
+    return 1;
+}
+
+static int test_unary(TestExpr *e, char op, const char *arg) {
+    struct stat sb;
+    switch (op) {
+    case 'n': return *arg != '\0';
+    case 'z': return *arg == '\0';
+    case 't': return isatty(atoi(arg));
+    case 'r': return access(arg, R_OK) == 0;
+    case 'w': return access(arg, W_OK) == 0;
+    case 'x': return access(arg, X_OK) == 0;
+    case 'h': case 'L': return lstat(arg, &sb) == 0 && S_ISLNK(sb.st_mode);
+    }
+    if (stat(arg, &sb) != 0) return 0;
+    switch (op) {
+    case 'e': return 1;
+    case 'f': return S_ISREG(sb.st_mode);
+    case 'd': return S_ISDIR(sb.st_mode);
+    case 's': return sb.st_size > 0;
+    case 'p': return S_ISFIFO(sb.st_mode);
+    case 'S': return S_ISSOCK(sb.st_mode);
+    case 'b': return S_ISBLK(sb.st_mode);
+    case 'c': return S_ISCHR(sb.st_mode);
+    }
+    return 0;
+}
+
+static const char *test_binary_ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+                                        "=", "==", "!=", "<", ">", "-nt", "-ot", NULL};
+
+static int test_binary_op(const char *op) {
+    for (int i = 0; test_binary_ops[i]; i++) {
+        if (strcmp(op, test_binary_ops[i]) == 0) return i;
+    }
+    return -1;
+}
+
+static int test_binary(TestExpr *e, const char *left, int op, const char *right) {
+    long long l = 0, r = 0;
+    if (op < 6 && (!test_integer(e, left, &l) || !test_integer(e, right, &r))) return 0;
+    struct stat a, b;
+    int have_a = op > 10 && stat(left, &a) == 0, have_b = op > 10 && stat(right, &b) == 0;
+    switch (op) {
+    case 0: return l == r;
+    case 1: return l != r;
+    case 2: return l < r;
+    case 3: return l <= r;
+    case 4: return l > r;
+    case 5: return l >= r;
+    case 6: case 7: return strcmp(left, right) == 0;
+    case 8: return strcmp(left, right) != 0;
+    case 9: return strcmp(left, right) < 0;
+    case 10: return strcmp(left, right) > 0;
+    case 11: return have_a && (!have_b || a.st_mtime > b.st_mtime);
+    default: return have_b && (!have_a || a.st_mtime < b.st_mtime);
+    }
+}
+
+static int test_primary(TestExpr *e) {
+    if (e->pos >= e->argc) {
+        e->error = 1;
+        fprintf(stderr, "test: argument expected\n");
+        return 0;
+    }
+    char *word = e->arg[e->pos++];
+    int op = e->pos + 1 < e->argc ? test_binary_op(e->arg[e->pos]) : -1;
+    if (op >= 0) {  // `left op right` wins over every other reading
+        e->pos += 2;
+        return test_binary(e, word, op, e->arg[e->pos - 1]);
+    }
+    if (strcmp(word, "(") == 0 && e->pos < e->argc) {
+        int result = test_or(e);
+        if (e->pos >= e->argc || strcmp(e->arg[e->pos], ")") != 0) {
+            if (!e->error) fprintf(stderr, "test: `)' expected\n");
+            e->error = 1;
+            return 0;
+        }
+        e->pos++;
+        return result;
+    }
+    if (word[0] == '-' && word[1] && !word[2] && strchr("nztrwxhLefdspSbc", word[1]) && e->pos < e->argc) {
+        return test_unary(e, word[1], e->arg[e->pos++]);
+    }
+    return *word != '\0';  // A lone string is true when not empty
+}
+
+static int test_not(TestExpr *e) {
+    if (e->pos + 1 < e->argc && strcmp(e->arg[e->pos], "!") == 0 &&
+        !(e->pos + 2 < e->argc && test_binary_op(e->arg[e->pos + 1]) >= 0)) {
+        e->pos++;
+        return !test_not(e);
+    }
+    return test_primary(e);
+}
+
+static int test_and(TestExpr *e) {
+    int result = test_not(e);
+    while (!e->error && e->pos < e->argc && strcmp(e->arg[e->pos], "-a") == 0) {
+        e->pos++;
+        result = test_not(e) && result;
+    }
+    return result;
+}
+
+static int test_or(TestExpr *e) {
+    int result = test_and(e);
+    while (!e->error && e->pos < e->argc && strcmp(e->arg[e->pos], "-o") == 0) {
+        e->pos++;
+        result = test_and(e) || result;
+    }
+    return result;
+}
+
+// test and [: exit status 0 if the expression holds, 1 if not, 2 on error
+int builtin_test(char *arglist[]) {
+    TestExpr e = {arglist + 1, 0, 0, 0};
+    while (e.arg[e.argc]) e.argc++;
+    if (strcmp(arglist[0], "[") == 0) {
+        if (e.argc == 0 || strcmp(e.arg[e.argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing `]'\n");
+            return 2;
+        }
+        e.argc--;
+    }
+    if (e.argc == 0) return 1;
+    int result = test_or(&e);
+    if (!e.error && e.pos < e.argc) {
+        fprintf(stderr, "%s: %s: unexpected argument\n", arglist[0], e.arg[e.pos]);
+        e.error = 1;
+    }
+    return e.error ? 2 : !result;
+}
+
+int builtin_true(char *arglist[]) {
+    return 0;
+}
+
+int builtin_false(char *arglist[]) {
+    return 1;
+}
+
+int builtin_pwd(char *arglist[]) {
+    puts(shell_cwd);
+    return 0;
+}
+
+// read NAME...: one line of stdin, split at whitespace with the rest going
+// to the last name. Pipes and terminals are read a byte at a time so
+// nothing after the line is consumed; seekable input is read in blocks
+// and rewound to just after the newline.
+int builtin_read(char *arglist[]) {
+    if (arglist[1] == NULL) {
+        fprintf(stderr, "Usage: read <variable>...\n");
+        return 2;
+    }
+    int seekable = lseek(STDIN_FILENO, 0, SEEK_CUR) != -1;
+    char buf[256];
+    char *line = NULL;
+    size_t len = 0, cap = 0;
+    int eof = 0;
+    while (1) {
+        ssize_t n = read(STDIN_FILENO, buf, seekable ? sizeof(buf) : 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            eof = 1;
+            break;
+        }
+        char *nl = memchr(buf, '\n', n);
+        size_t take = nl ? (size_t)(nl - buf) : (size_t)n;
+        if (nl && seekable) lseek(STDIN_FILENO, (nl + 1 - buf) - n, SEEK_CUR);
+        if (len + take + 1 > cap) {
+            cap = cap ? (len + take + 1) * 2 : 256;
+            char *bigger = realloc(line, cap);
+            if (!bigger) {
+                perror("read");
+                free(line);
+                return 1;
+            }
+            line = bigger;
+        }
+        memcpy(line + len, buf, take);
+        len += take;
+        if (nl) break;
+    }
+
+    char empty[1] = "";
+    char *rest = line ? line : empty;
+    if (line) line[len] = '\0';
+    for (int i = 1; arglist[i]; i++) {
+        rest += strspn(rest, " \t");
+        size_t word = arglist[i + 1] ? strcspn(rest, " \t") : strlen(rest);
+        while (!arglist[i + 1] && word > 0 && isspace((unsigned char)rest[word - 1])) word--;
+        char saved = rest[word];
+        rest[word] = '\0';
+        set_var(arglist[i], rest, 0);
+        rest[word] = saved;
+        rest += word;
+    }
+    free(line);
+    return eof;  // 1 at end of input, even after a last line without a newline
+}
+
+static void coproc_unset(Coproc *cp, const char *suffix) {
+    char var[sizeof(cp->name) + 8];
+    snprintf(var, sizeof(var), "%.63s_%s", cp->name, suffix);
+    remove_var(var);
+}
+
+static void coproc_set(Coproc *cp, const char *suffix, const char *fmt, int value) {
+    char var[sizeof(cp->name) + 8], text[32];
+    snprintf(var, sizeof(var), "%.63s_%s", cp->name, suffix);
+    snprintf(text, sizeof(text), fmt, value);
+    set_var(var, text, 0);
+}
+
+// Close the shell's end of a coprocess's stdin so that it sees EOF
+static void coproc_close_input(Coproc *cp) {
+    if (cp->in_fd >= 0) close(cp->in_fd);
+    cp->in_fd = -1;
+    coproc_unset(cp, "IN");
+}
+
+static Coproc *find_coproc(const char *name) {
+    for (int i = 0; i < COPROC_MAX; i++) {
+        if (coprocs[i].name[0] && strcmp(coprocs[i].name, name) == 0) return &coprocs[i];
+    }
+    return NULL;
+}
+
+// A coprocess exited. Writing to it is pointless, but what it printed
+// stays readable through NAME_OUT until its slot is reused.
+void coproc_exited(pid_t pid) {
+    for (int i = 0; i < COPROC_MAX; i++) {
+        Coproc *cp = &coprocs[i];
+        if (!cp->name[0] || cp->pid != pid) continue;
+        cp->pid = 0;
+        coproc_close_input(cp);
+        coproc_unset(cp, "PID");
+    }
+}
+
+int builtin_coproc(char *arglist[]) {
+    if (arglist[1] == NULL) {
+        for (int i = 0; i < COPROC_MAX; i++) {
+            Coproc *cp = &coprocs[i];
+            if (!cp->name[0]) continue;
+            printf("%s\t%d\t%s\n", cp->name, cp->pid, !cp->pid ? "exited" : cp->in_fd < 0 ? "input closed" : "running");
+        }
+        return 0;
+    }
+    if (strcmp(arglist[1], "-c") == 0) {
+        Coproc *cp = arglist[2] ? find_coproc(arglist[2]) : NULL;
+        if (!cp) {
+            fprintf(stderr, "coproc: %s: no such coprocess\n", arglist[2] ? arglist[2] : "");
+            return 1;
+        }
+        coproc_close_input(cp);
+        return 0;
+    }
+
+    const char *name = arglist[1];
+    int valid = arglist[2] && !isdigit((unsigned char)name[0]) && strlen(name) < sizeof(coprocs[0].name);
+    for (const char *c = name; *c && valid; c++) valid = isalnum((unsigned char)*c) || *c == '_';
+    if (!valid) {
+        fprintf(stderr, "Usage: coproc <name> <command> [args...] | coproc -c <name>\n");
+        return 2;
+    }
+    Coproc *cp = find_coproc(name);
+    if (cp && cp->pid) {
+        fprintf(stderr, "coproc: %s: already running\n", name);
+        return 1;
+    }
+    for (int i = 0; i < COPROC_MAX && !cp; i++) {  // A free slot, or else one that has exited
+        if (!coprocs[i].name[0]) cp = &coprocs[i];
+    }
+    for (int i = 0; i < COPROC_MAX && !cp; i++) {
+        if (!coprocs[i].pid) cp = &coprocs[i];
+    }
+    if (!cp) {
+        fprintf(stderr, "coproc: too many coprocesses\n");
+        return 1;
+    }
+    if (cp->name[0]) {  // Release the old one's output
+        close(cp->out_fd);
+        coproc_unset(cp, "OUT");
+        cp->name[0] = '\0';
+    }
+
+    int to[2], from[2];
+    if (pipe2(to, O_CLOEXEC) != 0) {
+        perror("pipe() failed");
+        return 1;
+    }
+    if (pipe2(from, O_CLOEXEC) != 0) {
+        perror("pipe() failed");
+        close(to[0]);
+        close(to[1]);
+        return 1;
+    }
+
+    // Run it as a background job with the pipes as its stdin and stdout
+    char in_path[32], out_path[32];
+    snprintf(in_path, sizeof(in_path), "/dev/fd/%d", to[0]);
+    snprintf(out_path, sizeof(out_path), "/dev/fd/%d", from[1]);
+    Stage st;
+    memset(&st, 0, sizeof(st));
+    st.argv = arglist + 2;
+    st.in_file = in_path;
+    st.out_file = out_path;
+    Pipeline pl;
+    memset(&pl, 0, sizeof(pl));
+    pl.stages = &st;
+    pl.nstages = 1;
+    pl.background = 1;
+    pl.name_expands = 1;  // Look the command up as a built-in
+    size_t len = 0;
+    for (int i = 0; arglist[i]; i++) len += strlen(arglist[i]) + 1;
+    char *text = arena_alloc(&cmd_arena, len);
+    if (text) {
+        char *end = text;
+        for (int i = 0; arglist[i]; i++) end += sprintf(end, "%s%s", i ? " " : "", arglist[i]);
+        pl.text = text;
+    }
+    run_pipeline(&pl);
+    close(to[0]);
+    close(from[1]);
+    if (!st.pid) {
+        close(to[1]);
+        close(from[0]);
+        return 1;
+    }
+
+    snprintf(cp->name, sizeof(cp->name), "%s", name);
+    cp->pid = st.pid;
+    cp->in_fd = to[1];
+    cp->out_fd = from[0];
+    coproc_set(cp, "IN", "/dev/fd/%d", to[1]);
+    coproc_set(cp, "OUT", "/dev/fd/%d", from[0]);
+    coproc_set(cp, "PID", "%d", st.pid);
+    return 0;
+}
+
+static UlimitResource *find_ulimit(char option) {
+    for (int r = 0; r < NUM_ULIMITS; r++) {
+        if (ulimit_resources[r].option == option) return &ulimit_resources[r];
+    }
+    return NULL;
+}
+
+// The limit the shell's next children get: the `ulimit` value, or the
+// shell's own limit they would inherit
+static void ulimit_get(UlimitResource *res, struct rlimit *rl) {
+    if (ulimit_set & 1u << res->resource) {
+        *rl = ulimit_values[res->resource];
+    } else if (getrlimit(res->resource, rl) != 0) {
+        rl->rlim_cur = rl->rlim_max = RLIM_INFINITY;
+    }
+}
+
+// ulimit [-H|-S] [-a | -RESOURCE [limit|unlimited]]. The limits are kept
+// for the commands the shell starts, which set them with setrlimit()
+// before they exec; the shell's own limits stay as they are. Without -H
+// or -S a new limit is both the soft and the hard one.
+int builtin_ulimit(char *arglist[]) {
+    int hard = 0, soft = 0, all = 0;
+    UlimitResource *res = find_ulimit('f');  // As in other shells
+    int i = 1;
+    for (; arglist[i] && arglist[i][0] == '-' && arglist[i][1]; i++) {
+        for (const char *cp = arglist[i] + 1; *cp; cp++) {
+            if (*cp == 'H') {
+                hard = 1;
+            } else if (*cp == 'S') {
+                soft = 1;
+            } else if (*cp == 'a') {
+                all = 1;
+            } else if (!(res = find_ulimit(*cp))) {
+                fprintf(stderr, "ulimit: -%c: invalid option\n", *cp);
+                return 2;
+            }
+        }
+    }
+
+    struct rlimit rl;
+    char shown[32];
+    if (all) {
+        for (int r = 0; r < NUM_ULIMITS; r++) {
+            ulimit_get(&ulimit_resources[r], &rl);
+            format_rlimit(hard ? rl.rlim_max : rl.rlim_cur, ulimit_resources[r].unit, "", shown, sizeof(shown));
+            printf("%-26s (-%c) %s\n", ulimit_resources[r].help, ulimit_resources[r].option, shown);
+        }
+        return 0;
+    }
+    ulimit_get(res, &rl);
+    if (arglist[i] == NULL) {
+        format_rlimit(hard ? rl.rlim_max : rl.rlim_cur, res->unit, "", shown, sizeof(shown));
+        printf("%s\n", shown);
+        return 0;
+    }
+    if (arglist[i + 1] != NULL) {
+        fprintf(stderr, "Usage: ulimit [-H|-S] [-a | -cdflnstuv [limit|unlimited]]\n");
+        return 2;
+    }
+
+    rlim_t value = RLIM_INFINITY;
+    if (strcmp(arglist[i], "unlimited") != 0) {
+        char *end;
+        errno = 0;
+        unsigned long long num = strtoull(arglist[i], &end, 10);
+        if (!isdigit((unsigned char)arglist[i][0]) || *end != '\0' || errno != 0 ||
+            num > (RLIM_INFINITY - 1) / res->unit) {
+            fprintf(stderr, "ulimit: %s: invalid limit\n", arglist[i]);
+            return 1;
+        }
+        value = num * res->unit;
+    }
+    if (!hard && !soft) hard = soft = 1;
+    if (soft) rl.rlim_cur = value;
+    if (hard) rl.rlim_max = value;
+    if (rl.rlim_cur > rl.rlim_max) {
+        fprintf(stderr, "ulimit: %s: soft limit above the hard limit\n", arglist[i]);
+        return 1;
+    }
+    // Try it in a throwaway child: only the kernel knows whether a hard
+    // limit may be raised, or how many open files are allowed
+    pid_t pid = fork();
+    if (pid == 0) _exit(setrlimit(res->resource, &rl) == 0 ? 0 : errno);
+    int status;
+    if (pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "ulimit: %s: %s\n", arglist[i], strerror(WEXITSTATUS(status)));
+        return 1;
+    }
+    ulimit_values[res->resource] = rl;
+    ulimit_set |= 1u << res->resource;
+    return 0;
+}
+
+int builtin_help(char *arglist[]);
+
+// Registry of built-in commands, kept sorted by name for bsearch()
+Builtin builtins[] = {
+    {"[", builtin_test, BUILTIN_PIPELINE, "[ expression ]", "same as test"},
+    {"cd", builtin_cd, BUILTIN_FORK, "cd [directory]", "change directory"},
+    {"coproc", builtin_coproc, 0, "coproc [name command...] | coproc -c <name>",
+     "start a background command reached through $name_IN and $name_OUT (-c: close its input)"},
+    {"echo", builtin_echo, BUILTIN_PIPELINE, "echo [-n] [-e] [text...]", "print text (-e: interpret escapes)"},
+    {"exit", builtin_exit, 0, "exit", "exit the shell"},
+    {"export", builtin_export, BUILTIN_FORK, "export <variable> <value>", "set a global (environment) variable"},
+    {"false", builtin_false, BUILTIN_PIPELINE, "false", "do nothing, unsuccessfully"},
+    {"get", builtin_get, BUILTIN_PIPELINE, "get <variable>", "print a variable"},
+    {"hash", builtin_hash, BUILTIN_PIPELINE, "hash [-r] [name...]", "list, clear or add remembered command paths"},
+    {"help", builtin_help, BUILTIN_PIPELINE, "help", "display this help message"},
+    {"history", builtin_history, BUILTIN_PIPELINE, "history [count] | history search <text>",
+     "list recent commands, or find commands containing text"},
+    {"jobs", builtin_jobs, BUILTIN_PIPELINE, "jobs", "list background jobs"},
+    {"kill", builtin_kill, BUILTIN_FORK, "kill [-signal] <job/pid>", "send a signal to a job or process"},
+    {"list", builtin_list, BUILTIN_PIPELINE, "list [-a]", "list variables (-a: with the environment)"},
+    {"parsecache", builtin_parsecache, BUILTIN_PIPELINE, "parsecache [-r]",
+     "show parse cache statistics (-r: empty the cache)"},
+    {"printf", builtin_printf, BUILTIN_PIPELINE, "printf <format> [arguments...]", "print formatted text"},
+    {"pwd", builtin_pwd, BUILTIN_PIPELINE, "pwd", "print the current directory"},
+    {"read", builtin_read, BUILTIN_PIPELINE, "read <variable>...", "set variables from a line of input"},
+    {"set", builtin_set, BUILTIN_FORK, "set <variable> <value>", "set a local variable"},
+    {"shopt", builtin_shopt, BUILTIN_PIPELINE, "shopt [option value]", "list or change shell options"},
+    {"test", builtin_test, BUILTIN_PIPELINE, "test expression", "check files, strings and numbers"},
+    {"trace", builtin_trace, BUILTIN_FORK, "trace [file]", "write the trace buffer as Chrome trace JSON"},
+    {"true", builtin_true, BUILTIN_PIPELINE, "true", "do nothing, successfully"},
+    {"ulimit", builtin_ulimit, BUILTIN_FORK, "ulimit [-H|-S] [-a | -cdflnstuv [limit]]",
+     "show or set resource limits of the commands the shell starts"},
+    {"unset", builtin_unset, BUILTIN_FORK, "unset <variable>", "delete a variable"},
+};
+#define NUM_BUILTINS (int)(sizeof(builtins) / sizeof(builtins[0]))
+
+int builtin_help(char *arglist[]) {
+    printf("Built-in commands:\n");
+    for (int i = 0; i < NUM_BUILTINS; i++) {
+        printf("  %s - %s\n", builtins[i].usage, builtins[i].help);
+    }
+    return 0;
+}
+
+static int compare_builtin(const void *key, const void *entry) {
+    return strcmp(key, ((const Builtin *)entry)->name);
+}
+
+Builtin *find_builtin(const char *name) {
+    return bsearch(name, builtins, NUM_BUILTINS, sizeof(Builtin), compare_builtin);
+}
+
+// Run arglist if it names a built-in command. Returns 1 if it did (with
+// the status in last_status), 0 if the command is external.
+int handle_builtin(char *arglist[]) {
+    Builtin *builtin = find_builtin(arglist[0]);
+    if (!builtin) return 0;
+    last_status = builtin->handler(arglist);
+    return 1;
+}
+
+// Run a built-in inside the shell with fds as its stdin, stdout and stderr
+// (-1 keeps the shell's own). The shell's descriptors are parked above 10
+// meanwhile and put back afterwards.
+int run_builtin(Builtin *builtin, char **argv, int fds[3]) {
+    int saved[3] = {-1, -1, -1};
+    int moved[3] = {0, 0, 0};
+    int ok = 1, status = 1;
+    fflush(stdout);  // What is buffered belongs to the old stdout
+    for (int i = 0; i < 3 && ok; i++) {
+        if (fds[i] < 0 || fds[i] == i) continue;
+        saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+        if (saved[i] < 0 && errno != EBADF) {  // EBADF: it was closed, close it again after
+            perror("fcntl");
+            ok = 0;  // The ones already moved are put back below
+            break;
+        }
+        moved[i] = 1;
+        if (dup2(fds[i], i) < 0) {
+            perror("dup2");
+            ok = 0;
+        }
+    }
+    // A reader that went away (a coprocess, a FIFO) must not kill the shell:
+    // the write fails with EPIPE instead
+    int output = fds[1] >= 0 || fds[2] >= 0;
+    struct sigaction ignore = {.sa_handler = SIG_IGN}, old_pipe;
+    if (output) sigaction(SIGPIPE, &ignore, &old_pipe);
+    if (ok) {
+        long long t = TRACE_BEGIN();
+        status = builtin->handler(argv);
+        TRACE_END("handle_builtin", t);
+    }
+    if (fflush(stdout) != 0 || ferror(stdout)) {
+        fprintf(stderr, "%s: write error: %s\n", argv[0], strerror(errno));
+        clearerr(stdout);
+        status = 1;
+    }
+    if (output) sigaction(SIGPIPE, &old_pipe, NULL);
+    for (int i = 0; i < 3; i++) {
+        if (!moved[i]) continue;
+        if (saved[i] >= 0) {
+            dup2(saved[i], i);
+            close(saved[i]);
+        } else {
+            close(i);
+        }
+    }
+    return status;
+}
+
+// Run a built-in in the shell with the stage's own redirections
+static int run_builtin_stage(Builtin *builtin, Stage *st) {
+    int fds[3] = {-1, -1, -1};
+    int status = 1;
+    if ((!st->in_file || (fds[0] = open_redirect(st->in_file, O_RDONLY, "input")) >= 0) &&
+        (!st->here || (fds[0] = here_fd(st->here)) >= 0) &&
+        (!st->out_file || (fds[1] = open_redirect(st->out_file, O_WRONLY | O_CREAT | O_TRUNC, "output")) >= 0) &&
+        (!st->err_file || (fds[2] = open_redirect(st->err_file, O_WRONLY | O_CREAT | O_TRUNC, "error")) >= 0)) {
+        status = run_builtin(builtin, st->argv, fds);
+    }
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] >= 0) close(fds[i]);
+    }
+    return status;
+}
+
+// Run a built-in as a pipeline stage in a child process, with the same
+// limits and job group as the external stages. Without an exec nothing
+// closes the pipeline's other pipe ends, so the child does.
+static pid_t fork_builtin(Pipeline *pl, Builtin *builtin, Stage *st, int fds[3], pid_t pgid, int cgroup_fd,
+                          int *pipes, int npipes) {
+    fflush(stdout);  // Or the child would print it again
+    pid_t cpid = fork();
+    if (cpid == 0) {
+        if (pgid != -1) setpgid(0, pgid);
+        for (int i = 0; i < 3; i++) {
+            if (fds[i] >= 0 && fds[i] != i) dup2(fds[i], i);
+        }
+        for (int i = 0; i < 3; i++) {
+            if (fds[i] > 2) close(fds[i]);
+        }
+        for (int i = 0; i < npipes; i++) {
+            if (pipes[i] > 2) close(pipes[i]);
+        }
+        SpawnRequest req = {NULL, st->argv, {-1, -1, -1}, pgid, pl->nice, pl->ioprio, cgroup_fd};
+        child_limits(&req);
+        sigprocmask(SIG_SETMASK, &orig_sigmask, NULL);
+        signal(SIGTTOU, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        interactive = 0;
+        int status = builtin->handler(st->argv);
+        fflush(stdout);
+        _exit(status);  // Skip the shell's atexit() handlers
+    }
+    if (cpid == -1) {
+        perror("fork() failed");
+        return -1;
+    }
+    if (pgid != -1) setpgid(cpid, pgid ? pgid : cpid);
+    return cpid;
+}
+
+// Start one pipeline stage with the given stdio, process group and job
+// group (cgroup_fd, or -1)
+pid_t execute(Pipeline *pl, Stage *stage, int fds[3], pid_t pgid, int cgroup_fd) {
+    // Resolve the command in the shell so the table fills in for next time
+    SpawnRequest req = {hash_command(stage->argv[0]), stage->argv, {fds[0], fds[1], fds[2]}, pgid,
+                        pl->nice, pl->ioprio, cgroup_fd};
+    pid_t (*spawn)(SpawnRequest *req) = spawn_backends[spawn_mode].spawn;
+    // posix_spawn() has no attributes for limits, priorities or cgroups
+    if (spawn == spawn_posix && (ulimit_set || req.nice || req.ioprio || cgroup_fd >= 0)) spawn = spawn_vfork;
+
+    fflush(stdout);  // Keep the shell's own output ordered before the child's
+    pid_t cpid = spawn(&req);
+    if (cpid == -1) return -1;  // The backend has already reported why
+    // Also set the group from the parent so it exists before we use it
+    if (pgid != -1) setpgid(cpid, pgid ? pgid : cpid);
+    return cpid;
+}
+
+static void child_warn(const char *msg) {
+    ssize_t n = write(STDERR_FILENO, msg, strlen(msg));
+    (void)n;  // Nothing is left to report a failure to
+}
+
+// Limits, priorities and job group of a new child. stdio may not be used
+// here, so a failure gets a fixed message and the command still runs.
+static void child_limits(SpawnRequest *req) {
+    if (req->cgroup_fd >= 0 && write(req->cgroup_fd, "0", 1) != 1) child_warn("cgroup: cannot join the job group\n");
+    for (int r = 0; r < RLIM_NLIMITS; r++) {
+        if ((ulimit_set & 1u << r) && setrlimit(r, &ulimit_values[r]) != 0) child_warn("ulimit: cannot set a limit\n");
+    }
+    if (req->nice && setpriority(PRIO_PROCESS, 0, getpriority(PRIO_PROCESS, 0) + req->nice) != 0) {
+        child_warn("nice: cannot set the niceness\n");
+    }
+    if (req->ioprio && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, req->ioprio) != 0) {
+        child_warn("ionice: cannot set the I/O priority\n");
+    }
+}
+
+// Child side of fork/vfork/clone: redirect stdio and replace the image.
+// The child may share the parent's memory, so nothing here may allocate.
+// Every descriptor the shell owns is O_CLOEXEC, so only the dup2() copies
+// on 0-2 survive the exec.
+static void child_exec(SpawnRequest *req) {
+    if (req->pgid != -1) setpgid(0, req->pgid);
+    for (int target = 0; target < 3; target++) {
+        if (req->fds[target] == target) {
+            fcntl(target, F_SETFD, 0);  // dup2() onto itself keeps close-on-exec
+        } else if (req->fds[target] != -1) {
+            dup2(req->fds[target], target);
+        }
+    }
+
+    child_limits(req);
+    sigprocmask(SIG_SETMASK, &orig_sigmask, NULL);  // The shell keeps SIGCHLD blocked
+    signal(SIGTTOU, SIG_DFL);  // Ignored by interactive shells
+
+    if (req->path) execve(req->path, req->argv, environ);
+    execvp(req->argv[0], req->argv);  // Not hashed, or needs the ENOEXEC fallback
+    // perror() would go through the parent's stdio, so the reason is a fixed text
+    child_warn(errno == ENOENT ? "!...command not found...!: No such file or directory\n"
+               : errno == EACCES ? "!...command not found...!: Permission denied\n"
+               : "!...command not found...!: cannot execute\n");
+    _exit(127);
+}
+
+pid_t spawn_fork(SpawnRequest *req) {
+    pid_t cpid = fork();
+    if (cpid == -1) {
+        perror("fork() failed");
+    } else if (cpid == 0) {
+        child_exec(req);
+    }
+    return cpid;
+}
+
+pid_t spawn_vfork(SpawnRequest *req) {
+    pid_t cpid = vfork();
+    if (cpid == -1) {
+        perror("vfork() failed");
+    } else if (cpid == 0) {
+        child_exec(req);
+    }
+    return cpid;
+}
+
+pid_t spawn_posix(SpawnRequest *req) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    for (int target = 0; target < 3; target++) {
+        if (req->fds[target] != -1) {
+            posix_spawn_file_actions_adddup2(&actions, req->fds[target], target);
+        }
+    }
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    posix_spawnattr_setsigmask(&attr, &orig_sigmask);  // The shell keeps SIGCHLD blocked
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGTTOU);  // Ignored by interactive shells
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    if (req->pgid != -1) {
+        posix_spawnattr_setpgroup(&attr, req->pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    pid_t cpid;
+    int err = req->path ? posix_spawn(&cpid, req->path, &actions, &attr, req->argv, environ)
+                        : posix_spawnp(&cpid, req->argv[0], &actions, &attr, req->argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+        fprintf(stderr, "!...command not found...!: %s\n", strerror(err));
+        return -1;
+    }
+    return cpid;
+}
+
+static int clone_child(void *arg) {
+    child_exec(arg);
+    return 127;
+}
+
+// CLONE_VM|CLONE_VFORK child on its own small stack. The parent sleeps until
+// the child execs or exits, so a single static stack is enough.
+pid_t spawn_clone(SpawnRequest *req) {
+    static char stack[CLONE_STACK_SIZE] __attribute__((aligned(16)));
+    pid_t cpid = clone(clone_child, stack + sizeof(stack), CLONE_VM | CLONE_VFORK | SIGCHLD, req);
+    if (cpid == -1) perror("clone() failed");
+    return cpid;
+}
+
+int set_option(const char *name, const char *value) {
+    for (int i = 0; i < NUM_OPTIONS; i++) {
+        if (strcmp(options[i].name, name) != 0) continue;
+        if (options[i].choices == NULL) {
+            char *end;
+            long num = strtol(value, &end, 10);
+            if (*value == '\0' || *end != '\0' || num < 0 || num > INT_MAX) {
+                fprintf(stderr, "shopt: %s: expected a number\n", name);
+                return 0;
+            }
+            *options[i].value = (int)num;
+            return 1;
+        }
+        for (int c = 0; options[i].choices[c] != NULL; c++) {
+            if (strcmp(options[i].choices[c], value) == 0) {
+                *options[i].value = c;
+                return 1;
+            }
+        }
+        fprintf(stderr, "shopt: %s: invalid value '%s'\n", name, value);
+        return 0;
+    }
+    fprintf(stderr, "shopt: %s: no such option\n", name);
+    return 0;
+}
+
+void list_options() {
+    for (int i = 0; i < NUM_OPTIONS; i++) {
+        if (options[i].choices) {
+            printf("%-14s %-12s (", options[i].name, options[i].choices[*options[i].value]);
+            for (int c = 0; options[i].choices[c] != NULL; c++) {
+                printf("%s%s", c ? "|" : "", options[i].choices[c]);
+            }
+            printf(") %s\n", options[i].help);
+        } else {
+            printf("%-14s %-12d %s\n", options[i].name, *options[i].value, options[i].help);
+        }
+    }
+}
+
+// FNV-1a string hash
+unsigned hash_string(const char *str) {
+    unsigned h = 2166136261u;
+    while (*str) {
+        h ^= (unsigned char)*str++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+unsigned hash_bytes(const char *str, size_t len) {
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)str[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int is_executable(const char *path, struct stat *st) {
+    return stat(path, st) == 0 && S_ISREG(st->st_mode) && access(path, X_OK) == 0;
+}
+
+// Walk $PATH the way execvp() would and return the first executable match
+const char *hash_lookup(const char *name) {
+    static char found[PATH_MAX];
+    const char *dirs = getenv("PATH");
+    if (!dirs) dirs = "/usr/local/bin:/usr/bin:/bin";
+    struct stat st;
+
+    while (1) {
+        const char *end = strchr(dirs, ':');
+        size_t len = end ? (size_t)(end - dirs) : strlen(dirs);
+        if (len == 0) {
+            snprintf(found, sizeof(found), "%s", name);  // Empty entry means cwd
+        } else {
+            snprintf(found, sizeof(found), "%.*s/%s", (int)len, dirs, name);
+        }
+        if (is_executable(found, &st)) return found;
+        if (!end) return NULL;
+        dirs = end + 1;
+    }
+}
+
+// Return the absolute path for name, filling the table on first use. Entries
+// whose file changed (inode or mtime) or disappeared are looked up again.
+const char *hash_command(const char *name) {
+    if (strchr(name, '/') != NULL) return NULL;  // Explicit paths bypass the table
+
+    unsigned bucket = hash_string(name) % CMD_HASH_SIZE;
+    CmdHash **link = &cmd_hash[bucket];
+    struct stat st;
+    while (*link) {
+        CmdHash *entry = *link;
+        if (strcmp(entry->name, name) == 0) {
+            if (stat(entry->path, &st) == 0 && st.st_dev == entry->dev &&
+                st.st_ino == entry->ino &&
+                st.st_mtim.tv_sec == entry->mtime.tv_sec &&
+                st.st_mtim.tv_nsec == entry->mtime.tv_nsec) {
+                entry->hits++;
+                return entry->path;
+            }
+            *link = entry->next;  // Stale: drop it and search again
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            break;
+        }
+        link = &entry->next;
+    }
+
+    const char *path = hash_lookup(name);
+    if (!path || stat(path, &st) != 0) return NULL;
+    if (path[0] != '/') return path;  // Relative PATH entries depend on the cwd
+
+    CmdHash *entry = malloc(sizeof(CmdHash));
+    if (!entry) return path;
+    entry->name = strdup(name);
+    entry->path = strdup(path);
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->mtime = st.st_mtim;
+    entry->hits = 1;
+    entry->next = cmd_hash[bucket];
+    cmd_hash[bucket] = entry;
+    return entry->path;
+}
+
+void hash_clear() {
+    for (int i = 0; i < CMD_HASH_SIZE; i++) {
+        CmdHash *entry = cmd_hash[i];
+        while (entry) {
+            CmdHash *next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        cmd_hash[i] = NULL;
+    }
+}
+
+void hash_list() {
+    int shown = 0;
+    for (int i = 0; i < CMD_HASH_SIZE; i++) {
+        for (CmdHash *entry = cmd_hash[i]; entry; entry = entry->next) {
+            if (!shown++) printf("hits\tcommand\n");
+            printf("%4u\t%s\n", entry->hits, entry->path);
+        }
+    }
+    if (!shown) printf("hash: hash table empty\n");
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Forget the command index; it is rebuilt by the next completion
+void command_index_clear() {
+    if (path_inotify_fd >= 0) {
+        if (event_ep >= 0) epoll_ctl(event_ep, EPOLL_CTL_DEL, path_inotify_fd, NULL);
+        close(path_inotify_fd);  // Drops every watch with it
+        path_inotify_fd = -1;
+    }
+    free(path_commands);
+    free(path_command_names);
+    path_commands = NULL;
+    path_command_names = NULL;
+    path_command_count = 0;
+    path_index_valid = 0;
+}
+
+// Collect the executables of every PATH directory into a sorted, unique
+// array and watch the directories for changes
+static void command_index_build() {
+    long long t = TRACE_BEGIN();
+    command_index_clear();
+    const char *path = getenv("PATH");
+    if (path == NULL) path = "/usr/local/bin:/usr/bin:/bin";
+    path_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (path_inotify_fd >= 0 && event_ep >= 0) {
+        struct epoll_event ev = {.events = EPOLLIN};
+        ev.data.fd = path_inotify_fd;
+        epoll_ctl(event_ep, EPOLL_CTL_ADD, path_inotify_fd, &ev);
+    }
+
+    // Names are collected as offsets into one growing buffer
+    size_t names_len = 0, names_cap = 0, count = 0, cap = 0;
+    size_t *offsets = NULL;
+    char *names = NULL;
+    int failed = 0;
+    while (*path && !failed) {
+        size_t len = strcspn(path, ":");
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%.*s", (int)(len ? len : 1), len ? path : ".");  // Empty means .
+        path += len + (path[len] == ':');
+
+        DIR *d = opendir(dir);
+        if (d == NULL) continue;
+        if (path_inotify_fd >= 0) {
+            inotify_add_watch(path_inotify_fd, dir,
+                              IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |
+                                  IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+        }
+        struct dirent *entry;
+        while ((entry = readdir(d)) != NULL) {
+            if (entry->d_name[0] == '.' || entry->d_type == DT_DIR) continue;
+            if (faccessat(dirfd(d), entry->d_name, X_OK, 0) != 0) continue;
+            struct stat sb;
+            if (entry->d_type != DT_REG &&
+                (fstatat(dirfd(d), entry->d_name, &sb, 0) != 0 || !S_ISREG(sb.st_mode))) continue;
+
+            size_t name_len = strlen(entry->d_name) + 1;
+            if (names_len + name_len > names_cap) {
+                names_cap = names_cap ? names_cap * 2 + name_len : 64 * 1024;
+                char *bigger = realloc(names, names_cap);
+                if (!bigger) break;
+                names = bigger;
+            }
+            if (count == cap) {
+                cap = cap ? cap * 2 : 1024;
+                size_t *more = realloc(offsets, sizeof(size_t) * cap);
+                if (!more) break;
+                offsets = more;
+            }
+            memcpy(names + names_len, entry->d_name, name_len);
+            offsets[count++] = names_len;
+            names_len += name_len;
+        }
+        failed = entry != NULL;
+        closedir(d);
+    }
+
+    path_commands = failed ? NULL : malloc(sizeof(char *) * (count + 1));
+    if (path_commands == NULL) {
+        perror("malloc() failed for command index");
+        free(offsets);
+        free(names);
+        command_index_clear();
+        return;
+    }
+    for (size_t i = 0; i < count; i++) path_commands[i] = names + offsets[i];
+    qsort(path_commands, count, sizeof(char *), compare_names);
+    size_t unique = 0;  // The first directory on PATH wins, but only the name matters here
+    for (size_t i = 0; i < count; i++) {
+        if (unique == 0 || strcmp(path_commands[unique - 1], path_commands[i]) != 0) {
+            path_commands[unique++] = path_commands[i];
+        }
+    }
+    free(offsets);
+    path_command_names = names;
+    path_command_count = unique;
+    path_index_valid = 1;
+    TRACE_END("command_index", t);
+}
+
+// Generators for rl_completion_matches(): state is 0 on the first call
+
+static char *complete_command(const char *text, int state) {
+    static int builtin, reserved;
+    static size_t next;
+    size_t len = strlen(text);
+    if (state == 0) {
+        builtin = reserved = 0;
+        if (!path_index_valid) command_index_build();
+        size_t lo = 0, hi = path_command_count;  // First name >= text
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (strcmp(path_commands[mid], text) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        next = lo;
+    }
+    while (builtin < NUM_BUILTINS) {
+        const char *name = builtins[builtin++].name;
+        if (strncmp(name, text, len) == 0) return strdup(name);
+    }
+    while (reserved_words[reserved]) {
+        const char *word = reserved_words[reserved++];
+        if (strncmp(word, text, len) == 0) return strdup(word);
+    }
+    if (next < path_command_count && strncmp(path_commands[next], text, len) == 0) {
+        return strdup(path_commands[next++]);
+    }
+    return NULL;
+}
+
+static char *complete_variable(const char *text, int state) {
+    static size_t slot;
+    if (state == 0) slot = 0;
+    size_t len = strlen(text);
+    while (slot < var_cap) {
+        Var *v = &vars[slot++];
+        if (v->name && v->name_len >= len && strncmp(v->name, text, len) == 0) return strndup(v->name, v->name_len);
+    }
+    return NULL;
+}
+
+static char *complete_job(const char *text, int state) {
+    static int slot;
+    if (state == 0) slot = job_head;
+    while (slot != -1) {
+        char id[16];
+        snprintf(id, sizeof(id), "%d", slot + 1);
+        slot = jobs[slot].next;
+        if (strncmp(id, text, strlen(text)) == 0) return strdup(id);
+    }
+    return NULL;
+}
+
+// Start of the word that ends before pos, or -1 at the start of a command
+static int previous_word(int pos, int *len) {
+    while (pos > 0 && isspace((unsigned char)rl_line_buffer[pos - 1])) pos--;
+    if (pos == 0 || strchr("|;&", rl_line_buffer[pos - 1])) return -1;
+    int end = pos;
+    while (pos > 0 && !isspace((unsigned char)rl_line_buffer[pos - 1]) && !strchr("|;&", rl_line_buffer[pos - 1])) {
+        pos--;
+    }
+    *len = end - pos;
+    return pos;
+}
+
+static int word_is(int start, int len, const char *word) {
+    return start >= 0 && (int)strlen(word) == len && strncmp(rl_line_buffer + start, word, len) == 0;
+}
+
+// Commands where one can start, $variables anywhere, job IDs after kill.
+// Anything else, and words containing a `/`, complete as file names.
+char **shell_completion(const char *text, int start, int end) {
+    int len = 0;
+    int prev = previous_word(start, &len);
+    rl_attempted_completion_over = 1;  // Do not add file names to our matches
+    // `$` and `{` break words for readline, so text is what follows them
+    const char *before = rl_line_buffer + start;
+    if (start > 1 && before[-1] == '{' && before[-2] == '$') {
+        rl_completion_append_character = '}';
+        return rl_completion_matches(text, complete_variable);
+    } else if (start > 0 && before[-1] == '$') {
+        return rl_completion_matches(text, complete_variable);
+    }
+    if (strchr(text, '/') == NULL) {
+        int command = prev == -1 || word_is(prev, len, "time");
+        for (int i = 0; reserved_words[i] && !command; i++) {
+            command = strcmp(reserved_words[i], "done") && strcmp(reserved_words[i], "fi") &&
+                      word_is(prev, len, reserved_words[i]);
+        }
+        if (command) return rl_completion_matches(text, complete_command);
+
+        int before_len = 0;
+        int before = prev >= 0 ? previous_word(prev, &before_len) : -1;
+        if (word_is(prev, len, "kill") || (prev >= 0 && rl_line_buffer[prev] == '-' && word_is(before, before_len, "kill"))) {
+            return rl_completion_matches(text, complete_job);
+        }
+    }
+    rl_attempted_completion_over = 0;
+    return NULL;
+}
+
+static unsigned pid_hash(pid_t pid) {
+    return (unsigned)pid * 2654435761u;  // Knuth multiplicative hash
+}
+
+static JobPid *job_pid_slot(pid_t pid) {
+    size_t mask = job_pids_cap - 1;
+    size_t i = pid_hash(pid) & mask;
+    while (job_pids[i].pid != 0 && job_pids[i].pid != pid) i = (i + 1) & mask;
+    return &job_pids[i];
+}
+
+// Index pid as a process of the job in slot, keeping the index half empty
+static int job_pid_insert(pid_t pid, int slot) {
+    if ((job_pids_count + 1) * 2 > job_pids_cap) {
+        size_t old_cap = job_pids_cap;
+        JobPid *old = job_pids;
+        job_pids_cap = old_cap ? old_cap * 2 : 2 * JOB_TABLE_MIN;
+        job_pids = calloc(job_pids_cap, sizeof(JobPid));
+        if (!job_pids) {
+            job_pids = old;
+            job_pids_cap = old_cap;
+            return 0;
+        }
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i].pid) *job_pid_slot(old[i].pid) = old[i];
+        }
+        free(old);
+    }
+    JobPid *entry = job_pid_slot(pid);
+    entry->pid = pid;
+    entry->slot = slot;
+    job_pids_count++;
+    return 1;
+}
+
+// Drop pid from the index and return its job slot, or -1
+static int job_pid_remove(pid_t pid) {
+    if (job_pids_count == 0) return -1;
+    JobPid *entry = job_pid_slot(pid);
+    if (entry->pid == 0) return -1;
+    int slot = entry->slot;
+
+    // Backward-shift deletion keeps every probe chain intact
+    size_t mask = job_pids_cap - 1;
+    size_t hole = entry - job_pids;
+    for (size_t i = (hole + 1) & mask; job_pids[i].pid != 0; i = (i + 1) & mask) {
+        size_t home = pid_hash(job_pids[i].pid) & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            job_pids[hole] = job_pids[i];
+            hole = i;
+        }
+    }
+    job_pids[hole].pid = 0;
+    job_pids_count--;
+    return slot;
+}
+
+// Double the table
+static int grow_jobs() {
+    int new_cap = job_cap ? job_cap * 2 : JOB_TABLE_MIN;
+    Job *new_jobs = realloc(jobs, sizeof(Job) * new_cap);
+    if (!new_jobs) return 0;
+    jobs = new_jobs;
+
+    // New slots go on the free list lowest first, so IDs stay small
+    for (int i = new_cap - 1; i >= job_cap; i--) {
+        jobs[i].pid = 0;
+        jobs[i].next = job_free;
+        job_free = i;
+    }
+    job_cap = new_cap;
+    return 1;
+}
+
+// Record a background pipeline as one job and return its ID
+int add_job(Pipeline *pl, pid_t pgid) {
+    if (job_free == -1 && !grow_jobs()) {
+        fprintf(stderr, "Job list full, cannot add more jobs.\n");
+        return 0;
+    }
+    int slot = job_free;
+    job_free = jobs[slot].next;
+
+    Job *job = &jobs[slot];
+    Stage *last = &pl->stages[pl->nstages - 1];
+    job->pid = last->pid ? last->pid : pgid;
+    job->pgid = pgid;
+    job->nprocs = 0;
+    job->status = 0;
+    for (int i = 0; i < pl->nstages; i++) {
+        if (pl->stages[i].pid && job_pid_insert(pl->stages[i].pid, slot)) job->nprocs++;
+    }
+    strncpy(job->command, pl->text ? pl->text : pl->stages[0].argv[0], 255);
+    job->command[255] = '\0';
+    job->cgroup_id = pl->cgroup_id;
+    describe_limits(pl, job->limits, sizeof(job->limits));
+
+    job->prev = job_tail;
+    job->next = -1;
+    if (job_tail != -1) {
+        jobs[job_tail].next = slot;
+    } else {
+        job_head = slot;
+    }
+    job_tail = slot;
+    job_count++;
+    return slot + 1;
+}
+
+Job *find_job(int job_id) {
+    if (job_id < 1 || job_id > job_cap || jobs[job_id - 1].pid == 0) return NULL;
+    return &jobs[job_id - 1];
+}
+
+// Return the slot of the job running pid, or -1
+int find_job_by_pid(pid_t pid) {
+    if (job_pids_count == 0) return -1;
+    JobPid *entry = job_pid_slot(pid);
+    return entry->pid ? entry->slot : -1;
+}
+
+// Release a job's slot once all its processes are reaped. Only touches the
+// job's neighbours, so finishing a job costs O(1).
+void remove_job(int slot) {
+    Job *job = &jobs[slot];
+    if (job->prev != -1) jobs[job->prev].next = job->next; else job_head = job->next;
+    if (job->next != -1) jobs[job->next].prev = job->prev; else job_tail = job->prev;
+    job->pid = 0;
+    job->next = job_free;
+    job_free = slot;
+    job_count--;
+    if (job->cgroup_id) cgroup_job_remove(job->cgroup_id);  // Empty now that all are reaped
+}
+
+void list_jobs() {
+    for (int slot = job_head; slot != -1; slot = jobs[slot].next) {
+        Job *job = &jobs[slot];
+        printf("[%d] %d %s%s%s%s\n", slot + 1, job->pid, job->command,
+               job->limits[0] ? "  (" : "", job->limits, job->limits[0] ? ")" : "");
+    }
+}
+
+// Write value to dir/file; with report set, say why it failed
+static int cgroup_write(const char *dir, const char *file, const char *value, int report) {
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    ssize_t n = fd >= 0 ? write(fd, value, strlen(value)) : -1;
+    int saved = errno;
+    if (fd >= 0) close(fd);
+    errno = saved;
+    if (n == (ssize_t)strlen(value)) return 0;
+    if (report) fprintf(stderr, "cgroup: %s: %s\n", path, strerror(errno));
+    return -1;
+}
+
+// Find the shell's cgroup v2 group and make <group>/myshell.<pid>, which
+// holds one group per job, with the cpu and memory controllers handed
+// down where the group has them. A shell that has to leave its group for
+// that joins <group>/myshell.shells, which every session shares: the shell
+// cannot remove a group it is still in when it exits. Returns 0, after saying why, when there
+// is no cgroup2 mount or the group is not delegated to this user.
+static int cgroup_setup() {
+    char line[PATH_MAX + 256], mount[PATH_MAX] = "", group[PATH_MAX] = "";
+    FILE *fp = fopen("/proc/self/mountinfo", "r");
+    while (fp && fgets(line, sizeof(line), fp)) {
+        // ID PARENT MAJ:MIN ROOT MOUNT-POINT OPTIONS ... - TYPE SOURCE ...
+        if (strstr(line, " - cgroup2 ") && sscanf(line, "%*s %*s %*s %*s %4095s", mount) == 1) break;
+        mount[0] = '\0';
+    }
+    if (fp) fclose(fp);
+    fp = fopen("/proc/self/cgroup", "r");
+    while (fp && fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "0::", 3) != 0) continue;
+        line[strcspn(line, "\n")] = '\0';
+        snprintf(group, sizeof(group), "%.*s", PATH_MAX - 1, strcmp(line + 3, "/") == 0 ? "" : line + 3);
+        break;
+    }
+    if (fp) fclose(fp);
+    if (!mount[0]) {
+        fprintf(stderr, "cgroup: no cgroup v2 hierarchy is mounted\n");
+        return 0;
+    }
+
+    char base[PATH_MAX + 16], path[PATH_MAX + 64];
+    snprintf(base, sizeof(base), "%.*s%s", PATH_MAX / 2, mount, group);
+    snprintf(path, sizeof(path), "%s/cgroup.procs", base);
+    if (access(path, W_OK) != 0) {
+        fprintf(stderr, "cgroup: %s is not delegated to this user\n", base);
+        return 0;
+    }
+
+    // Only groups without processes of their own may hand controllers
+    // down (the root is exempt), so the shell moves to a leaf if needed
+    char controllers[256] = "", enable[32] = "";
+    snprintf(path, sizeof(path), "%s/cgroup.controllers", base);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        ssize_t n = read(fd, controllers, sizeof(controllers) - 1);
+        controllers[n > 0 ? n : 0] = '\0';
+        close(fd);
+    }
+    char *save, *word;
+    for (word = strtok_r(controllers, " \n", &save); word; word = strtok_r(NULL, " \n", &save)) {
+        if (strcmp(word, "cpu") == 0 || strcmp(word, "memory") == 0) {
+            snprintf(enable + strlen(enable), sizeof(enable) - strlen(enable), "%s+%s", enable[0] ? " " : "", word);
+        }
+    }
+    if (enable[0] && cgroup_write(base, "cgroup.subtree_control", enable, 0) != 0 && errno == EBUSY) {
+        snprintf(path, sizeof(path), "%s/myshell.shells", base);
+        if ((mkdir(path, 0755) == 0 || errno == EEXIST) && cgroup_write(path, "cgroup.procs", "0", 1) == 0) {
+            cgroup_write(base, "cgroup.subtree_control", enable, 1);
+        }
+    }
+
+    snprintf(cgroup_jobs, sizeof(cgroup_jobs), "%.*s/myshell.%d", PATH_MAX - 32, base, getpid());
+    if (mkdir(cgroup_jobs, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "cgroup: %s: %s\n", cgroup_jobs, strerror(errno));
+        cgroup_jobs[0] = '\0';
+        return 0;
+    }
+    if (enable[0]) cgroup_write(cgroup_jobs, "cgroup.subtree_control", enable, 1);
+    atexit(cgroup_cleanup);
+    return 1;
+}
+
+// Make the group of one job with the configured limits. Returns its
+// cgroup.procs, open for the children to join before they exec, or -1.
+static int cgroup_job_create(int *id) {
+    if (!cgroup_jobs[0] && !cgroup_setup()) {
+        job_cgroup = 0;  // Said why once; `shopt cgroup on` tries again
+        return -1;
+    }
+    char dir[PATH_MAX + 32], value[64];
+    int n = ++cgroup_next_id;
+    snprintf(dir, sizeof(dir), "%s/job%d", cgroup_jobs, n);
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "cgroup: %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    // A limit the group cannot take (no such controller) is reported once
+    if (cgroup_cpu_pct) {
+        snprintf(value, sizeof(value), "%lld %d", (long long)cgroup_cpu_pct * CGROUP_CPU_PERIOD / 100, CGROUP_CPU_PERIOD);
+        if (cgroup_write(dir, "cpu.max", value, 1) != 0) cgroup_cpu_pct = 0;
+    }
+    if (cgroup_memory_mb) {
+        snprintf(value, sizeof(value), "%lld", (long long)cgroup_memory_mb << 20);
+        if (cgroup_write(dir, "memory.max", value, 1) != 0) cgroup_memory_mb = 0;
+    }
+    char procs[PATH_MAX + 64];
+    snprintf(procs, sizeof(procs), "%s/cgroup.procs", dir);
+    int fd = open(procs, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "cgroup: %s: %s\n", procs, strerror(errno));
+        rmdir(dir);
+        return -1;
+    }
+    *id = n;
+    return fd;
+}
+
+// Remove a job's group once its processes are gone. One that escaped
+// the job's waits (a daemon) keeps the group alive.
+static void cgroup_job_remove(int id) {
+    char dir[PATH_MAX + 32];
+    snprintf(dir, sizeof(dir), "%s/job%d", cgroup_jobs, id);
+    rmdir(dir);
+}
+
+static void cgroup_cleanup() {
+    if (cgroup_jobs[0]) rmdir(cgroup_jobs);  // Fails while background jobs still run
+}
+
+// A resource limit in the resource's units, with suffix after a number
+static void format_rlimit(rlim_t value, rlim_t unit, const char *suffix, char *buf, size_t size) {
+    if (value == RLIM_INFINITY) {
+        snprintf(buf, size, "unlimited");
+    } else {
+        snprintf(buf, size, "%llu%s", (unsigned long long)(value / unit), suffix);
+    }
+}
 
-// Variable handling functions
-int set_var(const char *name, const char *value, int global);
-void unset_var(const char *name);
-const char *get_var(const char *name);
-void list_vars();
-void expand_variables(char **arglist);
+// Add one item to a comma-separated list, truncating it when buf is full
+static void append_limit(char *buf, size_t size, size_t *len, const char *fmt, ...) {
+    if (*len > 0 && *len + 2 < size) *len += snprintf(buf + *len, size - *len, ", ");
+    if (*len + 1 >= size) return;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + *len, size - *len, fmt, ap);
+    va_end(ap);
+    if (n > 0) *len += (size_t)n < size - *len ? (size_t)n : size - *len - 1;
+}
 
-int main() {
-    struct sigaction sa;
-    sa.sa_handler = sigchld_handler;
-    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-    sigaction(SIGCHLD, &sa, NULL);
+// What the processes of pl are started with, for `jobs`: its prefixes,
+// the `ulimit` values and its job group's limits
+static void describe_limits(const Pipeline *pl, char *buf, size_t size) {
+    size_t len = 0;
+    buf[0] = '\0';
+    if (pl->nice) append_limit(buf, size, &len, "nice %d", pl->nice);
+    if (pl->ioprio) {
+        int ioclass = pl->ioprio >> IOPRIO_CLASS_SHIFT;
+        if (ioclass == IOPRIO_CLASS_IDLE) {
+            append_limit(buf, size, &len, "ionice idle");
+        } else {
+            append_limit(buf, size, &len, "ionice %s %d", ioprio_classes[ioclass],
+                         pl->ioprio & ((1 << IOPRIO_CLASS_SHIFT) - 1));
+        }
+    }
+    for (int i = 0; i < NUM_ULIMITS; i++) {
+        UlimitResource *res = &ulimit_resources[i];
+        if (!(ulimit_set & 1u << res->resource)) continue;
+        struct rlimit *rl = &ulimit_values[res->resource];
+        char soft[32], hard[32];
+        const char *suffix = res->unit > 1 ? "K" : "";
+        format_rlimit(rl->rlim_cur, res->unit, suffix, soft, sizeof(soft));
+        format_rlimit(rl->rlim_max, res->unit, suffix, hard, sizeof(hard));
+        if (rl->rlim_cur == rl->rlim_max) {
+            append_limit(buf, size, &len, "%s %s", res->name, soft);
+        } else {
+            append_limit(buf, size, &len, "%s %s/%s", res->name, soft, hard);
+        }
+    }
+    if (pl->cgroup_id) {
+        append_limit(buf, size, &len, "cgroup job%d", pl->cgroup_id);
+        if (cgroup_cpu_pct) append_limit(buf, size, &len, "cpu.max %d%%", cgroup_cpu_pct);
+        if (cgroup_memory_mb) append_limit(buf, size, &len, "memory.max %dM", cgroup_memory_mb);
+    }
+}
 
-    using_history();
-    read_history(HISTORY_FILE);
+// Kill every process of a job; it is removed once they are reaped
+void kill_job(int job_id) {
+    Job *job = find_job(job_id);
+    if (!job) {
+        fprintf(stderr, "kill: invalid job id %d\n", job_id);
+    } else {
+        if (kill(-job->pgid, SIGKILL) == 0) {
+            printf("Killed job [%d] %d\n", job_id, job->pid);
+        } else {
+            perror("kill");
+        }
+    }
+}
 
-    char *cmdline;
-    char **arglist;
-    char prompt[PATH_MAX + 50];
+// Tell the user a background job finished, keeping the prompt intact
+static void notify_job(int slot, int status) {
+    char state[64];
+    if (WIFSIGNALED(status)) {
+        snprintf(state, sizeof(state), "%s", strsignal(WTERMSIG(status)));
+    } else if (WEXITSTATUS(status) != 0) {
+        snprintf(state, sizeof(state), "Exit %d", WEXITSTATUS(status));
+    } else {
+        snprintf(state, sizeof(state), "Done");
+    }
 
-    while (1) {
-        display_prompt(prompt);
-        cmdline = readline(prompt);
+    if (prompt_active) rl_clear_visible_line();
+    printf("[%d] %s %d %s\n", slot + 1, state, jobs[slot].pid, jobs[slot].command);
+    if (prompt_active) rl_forced_update_display();
+}
 
-        if (!cmdline) break;  // Exit on EOF
+// Account for one reaped child; a job ends when its last process does
+void reap_pid(pid_t pid, int status) {
+    if (pid == prompt_worker) {
+        prompt_worker = 0;  // Its results arrive through prompt_worker_fd
+        return;
+    }
+    coproc_exited(pid);
+    int slot = job_pid_remove(pid);
+    if (slot == -1) return;  // Not a job, e.g. history compaction
+    Job *job = &jobs[slot];
+    if (pid == job->pid) job->status = status;
+    if (--job->nprocs > 0) return;
+    if (interactive) notify_job(slot, job->status);
+    remove_job(slot);  // Mark as terminated
+}
 
-        int background = 0;
-        if (cmdline[0] != '\0') {
-            add_history(cmdline);
-            write_history(HISTORY_FILE);
-        }
+// Collect every finished child. Runs from the main loop, never from a
+// signal handler, so the job table needs no further protection.
+void reap_children() {
+    struct signalfd_siginfo info;
+    while (read(sigchld_fd, &info, sizeof(info)) == sizeof(info)) {
+        // Pending signals are merged, so waitpid() below decides what exited
+    }
 
-        // Handle command repetition with `!number` and `!!`
-        if (cmdline[0] == '!') {
-            HIST_ENTRY *entry = NULL;
-            if (cmdline[1] == '!') {  // Repeat the last command
-                entry = previous_history();
-            } else {
-                int history_index = atoi(cmdline + 1) - 1;
-                if (history_index >= 0 && history_index < history_length) {
-                    entry = history_get(history_index + 1);
-                }
-            }
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        reap_pid(pid, status);
+    }
+}
 
-            if (entry) {
-                free(cmdline);
-                cmdline = strdup(entry->line);
-                printf("Repeating command: %s\n", cmdline);
-            } else {
-                printf("No such command in history.\n");
-                free(cmdline);
-                continue;
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    ArenaChunk *chunk = arena->head;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        // Grow geometrically so a huge line settles into a single chunk
+        size_t chunk_size = chunk ? chunk->size * 2 : ARENA_CHUNK;
+        if (chunk_size < size) chunk_size = size;
+        if (arena->spare && arena->spare->size >= size) {
+            chunk = arena->spare;  // Released by the previous loop iteration
+            arena->spare = NULL;
+        } else {
+            chunk = malloc(sizeof(ArenaChunk) + chunk_size);
+            if (!chunk) {
+                perror("malloc() failed for arena chunk");
+                return NULL;
             }
+            chunk->size = chunk_size;
+            arena->allocs++;
         }
+        chunk->next = arena->head;
+        chunk->used = 0;
+        arena->head = chunk;
+    }
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
 
-        if ((arglist = tokenize(cmdline, &background)) != NULL) {
-            expand_variables(arglist);  // Expand variables in the command
+char *arena_strdup(Arena *arena, const char *str) {
+    size_t len = strlen(str);
+    char *copy = arena_alloc(arena, len + 1);
+    if (copy) memcpy(copy, str, len + 1);
+    return copy;
+}
 
-            if (handle_builtin(arglist) == 0) {  // If it's a built-in command
-                handle_pipes_and_execute(arglist, background);  // External command handling
-            }
+// Free all memory of the arena, keeping only the largest chunk for reuse
+void arena_reset(Arena *arena) {
+    ArenaChunk *chunk = arena->head;
+    if (!chunk) return;
+    ArenaChunk *next = chunk->next;
+    while (next) {
+        ArenaChunk *tmp = next->next;
+        free(next);
+        next = tmp;
+    }
+    chunk->next = NULL;
+    chunk->used = 0;
+}
 
-            for (int j = 0; j < MAXARGS + 1; j++) {
-                free(arglist[j]);
-            }
-            free(arglist);
+ArenaMark arena_mark(Arena *arena) {
+    ArenaMark mark = {arena->head, arena->head ? arena->head->used : 0};
+    return mark;
+}
+
+// Free everything allocated since mark. The largest chunk let go is kept
+// as a spare, so a loop whose body overflows a chunk does not malloc()
+// and free() on every iteration.
+void arena_release(Arena *arena, ArenaMark mark) {
+    while (arena->head && arena->head != mark.chunk) {
+        ArenaChunk *chunk = arena->head;
+        arena->head = chunk->next;
+        if (!arena->spare || arena->spare->size < chunk->size) {
+            free(arena->spare);
+            arena->spare = chunk;
+        } else {
+            free(chunk);
         }
-        free(cmdline);
     }
+    if (arena->head) arena->head->used = mark.used;
+}
 
-    write_history(HISTORY_FILE);
-    printf("\n");
-    return 0;
+// Split cmdline into words. The line is copied into the command arena once
+// and every token is a NUL-terminated slice of that copy.
+static char semicolon[] = ";";
+static char here_ops[][4] = {"<<<", "<<-", "<<"};
+
+// Length of the `<<<`, `<<-` or `<<` that starts a word of len bytes
+// with its word attached, as in `<<EOF`; 0 for any other word.
+static size_t here_op_len(const char *word, size_t len) {
+    if (len < 3 || word[0] != '<' || word[1] != '<') return 0;
+    size_t op = word[2] == '<' || word[2] == '-' ? 3 : 2;
+    return len > op ? op : 0;
 }
 
-void display_prompt(char *prompt) {
-    char cwd[PATH_MAX];
-    if (getcwd(cwd, sizeof(cwd)) == NULL) {
-        perror("getcwd() error");
-        strcpy(cwd, "unknown");
+char **tokenize(char *cmdline, int *background) {
+    char *line = arena_strdup(&cmd_arena, cmdline);
+    if (!line) return NULL;
+
+    // First pass: count the words so arglist can be sized exactly. A `;`
+    // is always a word of its own.
+    int argnum = 0;
+    char *cp = line;
+    while (*cp != '\0') {
+        while (*cp == ' ' || *cp == '\t') cp++;
+        if (*cp == '\0') break;
+        argnum++;
+        if (*cp == ';') {
+            cp++;
+            continue;
+        }
+        size_t len = strcspn(cp, " \t;");
+        if (here_op_len(cp, len)) argnum++;  // `<<EOF` is two words
+        cp += len;
     }
-    snprintf(prompt, PATH_MAX + 50, "\n-(%s)-[%s]\n---$ ", PROMPT, cwd);
-}
 
-// Function to set a variable (local or global)
-int set_var(const char *name, const char *value, int global) {
-    // Check if variable already exists
-    for (int i = 0; i < var_count; i++) {
-        if (strncmp(vars[i].str, name, strlen(name)) == 0 && vars[i].str[strlen(name)] == '=') {
-            free(vars[i].str);
-            vars[i].str = malloc(strlen(name) + strlen(value) + 2);
-            sprintf(vars[i].str, "%s=%s", name, value);
-            vars[i].global = global;
-            if (global) setenv(name, value, 1);  // Update environment variable
-            return 1;
+    char **arglist = arena_alloc(&cmd_arena, sizeof(char *) * (argnum + 1));
+    if (!arglist) return NULL;
+
+    // Second pass: terminate each word in place and record its start
+    int i = 0;
+    cp = line;
+    while (*cp != '\0') {
+        while (*cp == ' ' || *cp == '\t') *cp++ = '\0';
+        if (*cp == '\0') break;
+        if (*cp == ';') {  // Ends the word before it, so it cannot stay in place
+            *cp++ = '\0';
+            arglist[i++] = semicolon;
+            continue;
         }
+        size_t len = strcspn(cp, " \t;");
+        size_t op = here_op_len(cp, len);
+        if (op) {  // No room to end the operator in place
+            arglist[i++] = here_ops[op == 2 ? 2 : cp[2] == '<' ? 0 : 1];
+            cp += op;
+            len -= op;
+        }
+        arglist[i++] = cp;
+        cp += len;
     }
 
-    // Add new variable if space is available
-    if (var_count < MAX_VARS) {
-        vars[var_count].str = malloc(strlen(name) + strlen(value) + 2);
-        sprintf(vars[var_count].str, "%s=%s", name, value);
-        vars[var_count].global = global;
-        if (global) setenv(name, value, 1);
-        var_count++;
-        return 1;
-    } else {
-        fprintf(stderr, "Variable storage limit reached.\n");
-        return 0;
+    if (argnum > 0 && strcmp(arglist[argnum - 1], "&") == 0) {
+        *background = 1;
+        argnum--;
     }
+    arglist[argnum] = NULL;
+    if (argnum == 0) return NULL;  // Nothing to run
+    return arglist;
 }
 
-// Function to unset a variable 
-void unset_var(const char *name) {
-    for (int i = 0; i < var_count; i++) {
-        // Check if the variable matches the name
-        if (strncmp(vars[i].str, name, strlen(name)) == 0 && vars[i].str[strlen(name)] == '=') {
-            free(vars[i].str); // Free the memory allocated for the variable string
+// Split arglist at each `|` into stages and pull out every stage's own
+// `<`, `>` and `2>` redirections. Returns NULL on a syntax error.
+Pipeline *parse_pipeline(char **arglist, int background) {
+    int nstages = 1;
+    for (int i = 0; arglist[i] != NULL; i++) {
+        if (strcmp(arglist[i], "|") == 0) nstages++;
+    }
 
-            // Shift remaining variables up
-            for (int j = i; j < var_count - 1; j++) {
-                vars[j] = vars[j + 1];
+    Pipeline *pl = arena_alloc(&cmd_arena, sizeof(Pipeline));
+    Stage *stages = arena_alloc(&cmd_arena, sizeof(Stage) * nstages);
+    if (!pl || !stages) return NULL;
+    memset(stages, 0, sizeof(Stage) * nstages);
+    pl->stages = stages;
+    pl->nstages = nstages;
+    pl->background = background;
+    pl->text = NULL;
+    pl->timed = TIME_OFF;
+    pl->builtin = NULL;
+    pl->name_expands = 0;
+    pl->nice = pl->ioprio = pl->cgroup_id = 0;
+
+    int s = 0;
+    int out = 0;  // Words are compacted in place over the operators
+    stages[0].argv = arglist;
+    for (int i = 0;; i++) {
+        char *word = arglist[i];
+        if (word == NULL || strcmp(word, "|") == 0) {
+            if (&arglist[out] == stages[s].argv) {
+                fprintf(stderr, "syntax error near `|'\n");
+                return NULL;
             }
+            arglist[out++] = NULL;
+            if (word == NULL) break;
+            stages[++s].argv = &arglist[out];
+            continue;
+        }
 
-            var_count--; // Decrement the variable count
-            printf("Variable %s unset.\n", name);
-            return;
+        const char **target = NULL;
+        if (strcmp(word, "<") == 0) {
+            target = &stages[s].in_file;
+            stages[s].here = NULL;  // The last input redirection wins
+        } else if (strcmp(word, "<<<") == 0 || strcmp(word, "<<") == 0 || strcmp(word, "<<-") == 0) {
+            if (arglist[i + 1] == NULL || strcmp(arglist[i + 1], "|") == 0) {
+                fprintf(stderr, "syntax error: missing word after `%s'\n", word);
+                return NULL;
+            }
+            const char *word_after = arglist[++i];
+            Stage *st = &stages[s];
+            st->in_file = NULL;
+            if (word[2] == '<') {  // Here-string: the word and a newline
+                size_t len = strlen(word_after);
+                char *text = arena_alloc(&cmd_arena, len + 2);
+                if (!text) return NULL;
+                memcpy(text, word_after, len);
+                memcpy(text + len, "\n", 2);
+                st->here = text;
+                st->here_literal = 0;
+            } else if (heredoc_used < heredoc_count) {  // Its body was read by heredoc_scan()
+                HereDoc *h = &heredocs[heredoc_used++];
+                st->here = h->body ? h->body : "";
+                st->here_literal = h->literal;
+            } else {
+                fprintf(stderr, "syntax error: here-document without a body\n");
+                return NULL;
+            }
+            continue;
+        } else if (strcmp(word, ">") == 0) {
+            target = &stages[s].out_file;
+        } else if (strcmp(word, "2>") == 0) {
+            target = &stages[s].err_file;
+        }
+        if (target) {
+            if (arglist[i + 1] == NULL || strcmp(arglist[i + 1], "|") == 0) {
+                fprintf(stderr, "syntax error: missing file after `%s'\n", word);
+                return NULL;
+            }
+            *target = arglist[++i];
+        } else {
+            arglist[out++] = word;
         }
     }
-    printf("Variable %s not found.\n", name);
+    return pl;
 }
 
-// Function to get the value of a variable
-const char *get_var(const char *name) {
-    for (int i = 0; i < var_count; i++) {
-        if (strncmp(vars[i].str, name, strlen(name)) == 0 && vars[i].str[strlen(name)] == '=') {
-            return vars[i].str + strlen(name) + 1;  // Return value part of name=value
+// Open a redirection target close-on-exec; reports failures
+static int open_redirect(const char *file, int flags, const char *what) {
+    int fd = open(file, flags | O_CLOEXEC, 0644);
+    if (fd < 0) fprintf(stderr, "Failed to open %s file %s: %s\n", what, file, strerror(errno));
+    return fd;
+}
+
+// Give a here-document to stdin without a file on disk or a process to
+// write it. A body that fits in a pipe is written into one before anyone
+// reads; a larger one goes into a sealed memfd, which readers can also
+// seek and map.
+static int here_fd(const char *body) {
+    size_t len = strlen(body);
+    int fd;
+    if (len <= HERE_PIPE_MAX) {
+        int p[2];
+        if (pipe2(p, O_CLOEXEC) != 0) {
+            perror("pipe() failed for here-document");
+            return -1;
+        }
+        ssize_t n = len ? write(p[1], body, len) : 0;  // Cannot block: a pipe holds PIPE_BUF
+        close(p[1]);
+        if (n != (ssize_t)len) {
+            perror("write() failed for here-document");
+            close(p[0]);
+            return -1;
+        }
+        return p[0];
+    }
+
+    fd = memfd_create("here-document", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        perror("memfd_create() failed for here-document");
+        return -1;
+    }
+    for (size_t done = 0; done < len;) {
+        ssize_t n = write(fd, body + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("write() failed for here-document");
+            close(fd);
+            return -1;
         }
+        done += n;
     }
-    return getenv(name);  // Check environment variables if not found in locals
+    // Sealed, a command that mmap()s or rewinds its stdin sees a fixed file
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
 }
 
-// Function to list all variables
-void list_vars() {
-    if (var_count == 0) {
-        printf("No variables to Display!");
-    } else {
-        printf("Local and environment variables:\n");
-        for (int i = 0; i < var_count; i++) {
-            printf("%s (%s)\n", vars[i].str, vars[i].global ? "global" : "local");
+// Convert a wait status to a shell exit code
+int exit_code(int status) {
+    if (status == -1) return 127;
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
+
+// Whether a stage ran, in a child or as a built-in inside the shell
+static int stage_ran(Stage *st) {
+    return st->pid || st->in_shell;
+}
+
+// Record per-stage exit codes and wall times in PIPESTATUS and PIPETIMES.
+// Their buffers only grow, so a pipeline allocates nothing here.
+static void set_pipe_status(Pipeline *pl) {
+    size_t size = pl->nstages * 24;
+    if (size > pipe_text_cap) {
+        char *codes = realloc(pipe_status_text, size);
+        if (codes) pipe_status_text = codes;
+        char *times = codes ? realloc(pipe_times_text, size) : NULL;
+        if (times) pipe_times_text = times;
+        if (!codes || !times) {
+            perror("realloc() failed for PIPESTATUS");
+            return;
         }
+        pipe_text_cap = size;
+    }
+    char *codes = pipe_status_text, *times = pipe_times_text;
+    size_t clen = 0, tlen = 0;
+    for (int i = 0; i < pl->nstages; i++) {
+        Stage *st = &pl->stages[i];
+        double secs = (st->end.tv_sec - st->start.tv_sec) + (st->end.tv_nsec - st->start.tv_nsec) / 1e9;
+        clen += snprintf(codes + clen, size - clen, "%s%d", i ? " " : "", stage_ran(st) ? exit_code(st->status) : 127);
+        tlen += snprintf(times + tlen, size - tlen, "%s%.3f", i ? " " : "", stage_ran(st) ? secs : 0.0);
     }
 }
 
-// Function to expand variables in the argument list
-void expand_variables(char **arglist) {
-    for (int i = 0; arglist[i] != NULL; i++) {
-        if (arglist[i][0] == '$') {
-            const char *value = get_var(arglist[i] + 1);
-            if (value) {
-                free(arglist[i]);
-                arglist[i] = strdup(value);
+// Start every stage at once, connected by close-on-exec pipes and placed
+// in one process group, then wait for all of them (foreground) or record
+// them as one job (background). Returns the wait status of the last stage.
+int run_pipeline(Pipeline *pl) {
+    int n = pl->nstages;
+    // Measured links get a second pipe each; their shell-side ends follow
+    // the stages' ends so forked built-ins close them too
+    int nlinks = pipe_stats && !pl->background ? n - 1 : 0;
+    Stage *tail = &pl->stages[n - 1];
+    Builtin *tail_builtin = nlinks && tail->argv[0] ? find_builtin(tail->argv[0]) : NULL;
+    if (tail_builtin && !(tail_builtin->flags & BUILTIN_FORK)) nlinks = 0;  // It reads in the shell, which could not relay
+    PipeLink *links = nlinks ? arena_alloc(&cmd_arena, sizeof(PipeLink) * nlinks) : NULL;
+    if (!links) nlinks = 0;
+    int npipes = 2 * (n - 1 + nlinks);
+    int *pipes = arena_alloc(&cmd_arena, sizeof(int) * (npipes > 0 ? npipes : 1));
+    if (!pipes) return -1;
+    for (int i = 0; i < npipes; i++) pipes[i] = -1;
+    int warned = 0;
+    for (int i = 0; i < n - 1; i++) {
+        int *relay = &pipes[2 * (n - 1 + i)];
+        if (pipe2(&pipes[2 * i], O_CLOEXEC) == -1 || (i < nlinks && pipe2(relay, O_CLOEXEC) == -1)) {
+            perror("pipe() failed");
+            for (int j = 0; j < npipes; j++) {
+                if (pipes[j] >= 0) close(pipes[j]);
             }
+            return -1;
+        }
+        set_pipe_size(pipes[2 * i + 1], &warned);
+        if (i < nlinks) {
+            // Stage i writes into the first pipe and stage i+1 reads the second
+            set_pipe_size(relay[1], &warned);
+            int from = pipes[2 * i];
+            pipes[2 * i] = relay[0];
+            relay[0] = from;
+            memset(&links[i], 0, sizeof(PipeLink));
+            links[i].from = from;
+            links[i].to = relay[1];
         }
     }
-}
 
-// Extended handle_builtin to add variable-related commands
-int handle_builtin(char *arglist[]) {
-    if (strcmp(arglist[0], "cd") == 0) {
-        if (arglist[1] == NULL) {
-            fprintf(stderr, "cd: missing operand\n");
-        } else if (chdir(arglist[1]) != 0) {
-            perror("cd");
+    int cgroup_fd = job_cgroup ? cgroup_job_create(&pl->cgroup_id) : -1;
+
+    // Job control needs a terminal; scripts keep children in the shell's group
+    int own_group = interactive || pl->background;
+    pid_t pgid = own_group ? 0 : -1;
+    int foreground = 0;  // Whether the pipeline already has the terminal
+    for (int i = 0; i < n; i++) {
+        Stage *st = &pl->stages[i];
+        int fds[3] = {i > 0 ? pipes[2 * (i - 1)] : -1, i < n - 1 ? pipes[2 * i + 1] : -1, -1};
+        int ok = st->argv[0] != NULL;  // Not if the stage expanded to nothing
+        if (ok && st->in_file && (fds[0] = open_redirect(st->in_file, O_RDONLY, "input")) < 0) ok = 0;
+        if (ok && st->here && (fds[0] = here_fd(st->here)) < 0) ok = 0;
+        if (ok && st->out_file &&
+            (fds[1] = open_redirect(st->out_file, O_WRONLY | O_CREAT | O_TRUNC, "output")) < 0) ok = 0;
+        if (ok && st->err_file &&
+            (fds[2] = open_redirect(st->err_file, O_WRONLY | O_CREAT | O_TRUNC, "error")) < 0) ok = 0;
+
+        Builtin *builtin = NULL;
+        if (ok) builtin = i == 0 && !pl->name_expands ? pl->builtin : find_builtin(st->argv[0]);
+        if (builtin && !(builtin->flags & (BUILTIN_PIPELINE | BUILTIN_FORK))) {
+            fprintf(stderr, "%s: cannot be part of a pipeline or background job\n", st->argv[0]);
+            ok = 0;
         }
-        return 1;
-    } else if (strcmp(arglist[0], "exit") == 0) {
-        printf("Exit Successfully!\n");
-        exit(0);
-    } else if (strcmp(arglist[0], "set") == 0) {
-        if (arglist[1] && arglist[2]) {
-            set_var(arglist[1], arglist[2], 0);  // Set local variable
+
+        clock_gettime(CLOCK_MONOTONIC, &st->start);
+        long long t = TRACE_BEGIN();
+        if (builtin && ok && i == n - 1 && !pl->background && !(builtin->flags & BUILTIN_FORK)) {
+            // The last stage needs no process of its own: run it here while
+            // the others write into its stdin. They may read the terminal,
+            // so it is theirs before the shell blocks on the pipe.
+            if (interactive && pgid > 0) {
+                tcsetpgrp(STDIN_FILENO, pgid);
+                kill(-pgid, SIGCONT);
+                foreground = 1;
+            }
+            st->status = W_EXITCODE(run_builtin(builtin, st->argv, fds), 0);
+            st->in_shell = 1;
+            clock_gettime(CLOCK_MONOTONIC, &st->end);
+        } else if (builtin && ok) {
+            st->pid = fork_builtin(pl, builtin, st, fds, pgid, cgroup_fd, pipes, npipes);
         } else {
-            printf("Usage: set <variable> <value>\n");
+            st->pid = ok ? execute(pl, st, fds, pgid, cgroup_fd) : -1;
         }
-        return 1;
-    } else if (strcmp(arglist[0], "unset") == 0) {
-        if (arglist[1] == NULL) {
-            fprintf(stderr, "unset: missing variable name\n");
-        } else {
-            unset_var(arglist[1]);
+        TRACE_END("execute", t);
+        if (st->pid == -1) {
+            st->pid = 0;
+            st->end = st->start;
+        } else if (pgid == 0 && st->pid) {
+            pgid = st->pid;  // The first stage leads the group
         }
-        return 1;
-    } else if (strcmp(arglist[0], "export") == 0) {
-        if (arglist[1] && arglist[2]) {
-            set_var(arglist[1], arglist[2], 1);  // Set global (environment) variable
-        } else {
-            printf("Usage: export <variable> <value>\n");
+
+        // The child has its copies; close ours so EOF propagates
+        if ((st->in_file || st->here) && fds[0] >= 0) close(fds[0]);
+        if (st->out_file && fds[1] >= 0) close(fds[1]);
+        if (st->err_file && fds[2] >= 0) close(fds[2]);
+        if (i > 0) close(pipes[2 * (i - 1)]);
+        if (i < n - 1) close(pipes[2 * i + 1]);
+    }
+
+    if (cgroup_fd >= 0) close(cgroup_fd);
+
+    Stage *last = &pl->stages[n - 1];
+    if (pl->background) {
+        if (pgid > 0) {
+            int job_id = add_job(pl, pgid);
+            last_background_pid = last->pid ? last->pid : pgid;
+            printf("[%d] %d\n", job_id, last_background_pid);
+        } else if (pl->cgroup_id) {
+            cgroup_job_remove(pl->cgroup_id);  // Nothing started
         }
-        return 1;
-    } else if (strcmp(arglist[0], "get") == 0) {
-        if (arglist[1]) {
-            const char *value = get_var(arglist[1]);
-            if (value) {
-                printf("%s=%s\n", arglist[1], value);
-            } else {
-                printf("%s not found.\n", arglist[1]);
-            }
-        } else {
-            printf("Usage: get <variable>\n");
+        return 0;
+    }
+
+    // Hand the terminal to the pipeline while it runs
+    if (interactive && pgid > 0 && !foreground) {
+        tcsetpgrp(STDIN_FILENO, pgid);
+        kill(-pgid, SIGCONT);  // In case a stage read the terminal too early
+    }
+
+    long long t_wait = TRACE_BEGIN();
+    if (nlinks) relay_links(links, nlinks);
+    int remaining = 0;
+    for (int i = 0; i < n; i++) {
+        if (pl->stages[i].pid) remaining++;
+    }
+    while (remaining > 0) {
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(-1, &status, 0, &usage);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            perror("wait4");
+            break;
         }
-        return 1;
-    } else if (strcmp(arglist[0], "list") == 0) {
-        list_vars();
-        return 1;
-    }  else if (strcmp(arglist[0], "jobs") == 0) {
-        if (are_jobs_present()) { // Check for job presence
-            list_jobs(); // List the jobs if present
-            return 1;
-        } else {
-            // If no jobs are present
-            printf("No jobs Found.\n");
-            return -1; // Return value for no jobs
+        int i;
+        for (i = 0; i < n && pl->stages[i].pid != pid; i++) {
         }
-    } else if (strcmp(arglist[0], "kill") == 0) {
-        if (arglist[1] == NULL) {
-            fprintf(stderr, "kill: missing PID or job ID\n");
-        } else {
-            int signal = SIGKILL;  // Default signal is SIGKILL
-            int target_pid = -1;   // PID to kill
-            int job_id = -1;       // Initialize job ID as -1 (not found)
-            
-            // Check if a signal is provided (e.g., kill -9 <job_id/PID>)
-            if (arglist[1][0] == '-') {
-                signal = atoi(arglist[1] + 1);
-                job_id = atoi(arglist[2]);  // Job ID or PID as the next argument
-            } else {
-                job_id = atoi(arglist[1]);  // Treat arglist[1] as job ID or PID
-            }
+        if (i == n) {
+            reap_pid(pid, status);  // A background job finished meanwhile
+            continue;
+        }
+        pl->stages[i].status = status;
+        pl->stages[i].usage = usage;
+        if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT) interrupted = 1;  // Stop loops too
+        clock_gettime(CLOCK_MONOTONIC, &pl->stages[i].end);
+        remaining--;
+    }
 
-            // Attempt to find the PID by job ID first
-            if (job_id > 0 && job_id <= job_count && jobs[job_id - 1].pid != 0) {
-                target_pid = jobs[job_id - 1].pid;  // Retrieve PID from job ID
-            } else {
-                target_pid = job_id;  // If no job match, assume it's a PID
+    TRACE_END("wait4", t_wait);
+    if (trace_events) {
+        // Each child's lifetime, on its own track
+        for (int i = 0; i < n; i++) {
+            Stage *st = &pl->stages[i];
+            if (!st->pid) continue;
+            trace_record("process", st->start.tv_sec * 1000000000LL + st->start.tv_nsec,
+                         st->end.tv_sec * 1000000000LL + st->end.tv_nsec, st->pid);
+        }
+    }
+
+    if (interactive && pgid > 0) tcsetpgrp(STDIN_FILENO, getpgrp());
+    if (pl->cgroup_id) cgroup_job_remove(pl->cgroup_id);
+    set_pipe_status(pl);
+    if (pl->timed) report_times(pl);
+    if (nlinks) report_links(pl, links);
+    return stage_ran(last) ? last->status : -1;
+}
+
+// Apply `shopt pipe_size` to a new pipe. The kernel rounds the size up
+// to a power of two pages; beyond /proc/sys/fs/pipe-max-size it refuses.
+static void set_pipe_size(int fd, int *warned) {
+    if (pipe_size == 0 || fcntl(fd, F_SETPIPE_SZ, pipe_size) >= 0 || *warned) return;
+    fprintf(stderr, "pipe_size %d: %s\n", pipe_size, strerror(errno));
+    *warned = 1;  // Once per pipeline
+}
+
+// Move data across each measured link until all of them are closed. The
+// shell cannot watch a pipe without holding one of its ends, which would
+// keep EOF and SIGPIPE from the stages, so it sits in the middle instead.
+// splice() moves the pages without copying them. Each link is sampled
+// when one of the pipes or a child wakes the shell. Only a link with data
+// queued for the next stage can turn empty without either, so while one
+// has, the shell also looks every LINK_SAMPLE_MS.
+static void relay_links(PipeLink *links, int nlinks) {
+    struct pollfd *pfds = arena_alloc(&cmd_arena, sizeof(struct pollfd) * (nlinks + 1));
+    if (!pfds) return;
+    void (*old_pipe)(int) = signal(SIGPIPE, SIG_IGN);  // A reader that exits is seen as EPIPE
+    struct timespec last, now;
+    clock_gettime(CLOCK_MONOTONIC, &last);
+    int open = nlinks;
+    while (open > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long ns = (now.tv_sec - last.tv_sec) * 1000000000LL + (now.tv_nsec - last.tv_nsec);
+        last = now;
+
+        int npoll = 0, flowing = 0;
+        for (int i = 0; i < nlinks; i++) {
+            PipeLink *l = &links[i];
+            if (l->from < 0) continue;
+            l->open_ns += ns;  // Charged to the state seen at the previous sample
+            if (l->state == LINK_FULL) l->full_ns += ns;
+            if (l->state == LINK_EMPTY) l->empty_ns += ns;
+
+            ssize_t moved;
+            while ((moved = splice(l->from, NULL, l->to, NULL, INT_MAX, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) > 0 ||
+                   (moved < 0 && errno == EINTR)) {
+                if (moved > 0) l->bytes += moved;
+            }
+            if (moved == 0 || errno != EAGAIN) {
+                // EOF from stage i, or stage i+1 has gone: pass it along
+                close(l->from);
+                close(l->to);
+                l->from = l->to = -1;
+                open--;
+                continue;
             }
 
-            // Kill the process using the target PID
-            if (target_pid <= 0 || kill(target_pid, signal) != 0) {
-                perror("kill");
+            int queued_in = 0, queued_out = 0;
+            ioctl(l->from, FIONREAD, &queued_in);
+            ioctl(l->to, FIONREAD, &queued_out);
+            if (queued_in > 0) {  // Left behind because the next pipe is full
+                l->state = LINK_FULL;
+                pfds[npoll++] = (struct pollfd){l->to, POLLOUT, 0};
             } else {
-                printf("Killed %s [%d] %d\n", (job_id == target_pid ? "process" : "job"), job_id, target_pid);
-                // Mark the job as terminated if killed by job ID
-                if (job_id <= job_count && job_id > 0 && jobs[job_id - 1].pid == target_pid) {
-                    jobs[job_id - 1].pid = 0;
-                }
+                l->state = queued_out > 0 ? LINK_FLOWING : LINK_EMPTY;
+                if (l->state == LINK_FLOWING) flowing = 1;
+                pfds[npoll++] = (struct pollfd){l->from, POLLIN, 0};
+            }
+        }
+        if (npoll == 0) break;
+        pfds[npoll++] = (struct pollfd){sigchld_fd, POLLIN, 0};
+        if (poll(pfds, npoll, flowing ? LINK_SAMPLE_MS : -1) > 0 && pfds[npoll - 1].revents) {
+            // The wait4() loop after the relay decides what exited
+            struct signalfd_siginfo info;
+            while (read(sigchld_fd, &info, sizeof(info)) == sizeof(info)) {
             }
         }
-        return 1;
-    } else if (strcmp(arglist[0], "help") == 0) {
-        printf("Built-in commands:\n");
-        printf("  cd [directory] - change directory\n");
-        printf("  exit - exit the shell\n");
-        printf("  jobs - list background jobs\n");
-        printf("  kill [-signal] <pid> - send a signal to a process\n");
-        printf("  help - display this help message\n");
-        return 1;
     }
-    return 0;
+    signal(SIGPIPE, old_pipe);
 }
 
-int execute(char *arglist[], int input_fd, int output_fd, int error_fd, int background) {
-    pid_t cpid = fork();
-    if (cpid == -1) {
-        perror("fork() failed");
-        exit(1);
+// Print what went through each link of a pipe_stats pipeline. A link that
+// was often full points at a slow stage after it; one that was often empty
+// at a slow stage before it.
+static void report_links(Pipeline *pl, PipeLink *links) {
+    fprintf(stderr, "%12s %9s %9s %9s  %s\n", "bytes", "MB/s", "full", "empty", "pipe");
+    for (int i = 0; i < pl->nstages - 1; i++) {
+        PipeLink *l = &links[i];
+        const char *from = pl->stages[i].argv[0], *to = pl->stages[i + 1].argv[0];
+        fprintf(stderr, "%12llu %9.1f %9.3f %9.3f  %s -> %s\n", l->bytes,
+                l->open_ns > 0 ? l->bytes / (l->open_ns / 1e9) / 1e6 : 0.0,
+                l->full_ns / 1e9, l->empty_ns / 1e9, from ? from : "-", to ? to : "-");
     }
-    if (cpid == 0) {
-        if (input_fd != -1) {
-            dup2(input_fd, STDIN_FILENO);
-            close(input_fd);
-        }
-        if (output_fd != -1) {
-            dup2(output_fd, STDOUT_FILENO);
-            close(output_fd);
-        }
-        if (error_fd != -1) {
-            dup2(error_fd, STDERR_FILENO);
-            close(error_fd);
-        }
+}
 
-        execvp(arglist[0], arglist);
-        perror("!...command not found...!");
-        exit(1);
-    } else {
-        if (background) {
-            add_job(cpid, arglist[0]);
-            printf("[%d] %d\n", job_count, cpid);
-            return 0;
-        } else {
-            int status;
-            waitpid(cpid, &status, 0);
-            return status;
+static void parse_lru_unlink(ParseEntry *e) {
+    if (e->prev) e->prev->next = e->next; else parse_lru_head = e->next;
+    if (e->next) e->next->prev = e->prev; else parse_lru_tail = e->prev;
+}
+
+static void parse_lru_push(ParseEntry *e) {
+    e->prev = NULL;
+    e->next = parse_lru_head;
+    if (parse_lru_head) parse_lru_head->prev = e; else parse_lru_tail = e;
+    parse_lru_head = e;
+}
+
+static void parse_cache_remove(ParseEntry *e) {
+    ParseEntry **pp = &parse_cache[e->hash % PARSE_CACHE_BUCKETS];
+    while (*pp != e) pp = &(*pp)->chain;
+    *pp = e->chain;
+    parse_lru_unlink(e);
+    parse_cache_count--;
+    free(e);  // Text, words and layout share the one allocation
+}
+
+void parse_cache_clear() {
+    while (parse_lru_head) parse_cache_remove(parse_lru_head);
+}
+
+// Append a word to the entry's word block, returning its offset
+static int store_word(ParseEntry *e, size_t *used, const char *word) {
+    if (!word) return -1;
+    size_t len = strlen(word) + 1;
+    memcpy(e->words + *used, word, len);
+    *used += len;
+    return (int)(*used - len);
+}
+
+// Remember a freshly parsed pipeline, evicting the least recently used
+// entries beyond parse_cache_max
+static void parse_cache_store(const char *text, size_t text_len, unsigned hash, Pipeline *pl) {
+    while (parse_cache_count > 0 && parse_cache_count >= parse_cache_max) {
+        parse_cache_remove(parse_lru_tail);
+        parse_evictions++;
+    }
+    if (parse_cache_max <= 0) return;
+    size_t words_size = 0, layout_len = 0;
+    for (int i = 0; i < pl->nstages; i++) {
+        Stage *st = &pl->stages[i];
+        const char *files[4] = {st->in_file, st->out_file, st->err_file, st->here};
+        for (int f = 0; f < 4; f++) {
+            if (files[f]) words_size += strlen(files[f]) + 1;
         }
+        layout_len += 5;
+        for (char **w = st->argv; *w; w++, layout_len++) words_size += strlen(*w) + 1;
     }
+    if (words_size > INT_MAX) return;
+
+    ParseEntry *e = malloc(sizeof(ParseEntry) + sizeof(int) * layout_len + text_len + 1 + words_size);
+    if (!e) return;  // Just not cached
+    e->layout = (int *)(e + 1);
+    e->text = (char *)(e->layout + layout_len);
+    e->words = e->text + text_len + 1;
+    memcpy(e->text, text, text_len + 1);
+    e->text_len = text_len;
+    e->hash = hash;
+    e->nstages = pl->nstages;
+    e->background = pl->background;
+    e->timed = pl->timed;
+    e->builtin = pl->builtin;
+    e->name_expands = pl->name_expands;
+    e->nice = pl->nice;
+    e->ioprio = pl->ioprio;
+    e->words_size = words_size;
+
+    size_t used = 0;
+    int *lp = e->layout;
+    for (int i = 0; i < pl->nstages; i++) {
+        Stage *st = &pl->stages[i];
+        int *argc = lp++;
+        *lp++ = store_word(e, &used, st->in_file);
+        *lp++ = store_word(e, &used, st->out_file);
+        *lp++ = store_word(e, &used, st->err_file);
+        *lp++ = store_word(e, &used, st->here);  // Only here-strings: here-document lines are not cached
+        for (*argc = 0; st->argv[*argc]; (*argc)++) *lp++ = store_word(e, &used, st->argv[*argc]);
+    }
+
+    ParseEntry **bucket = &parse_cache[hash % PARSE_CACHE_BUCKETS];
+    e->chain = *bucket;
+    *bucket = e;
+    parse_lru_push(e);
+    parse_cache_count++;
 }
 
-void add_job(pid_t pid, const char *command) {
-    if (job_count < MAX_JOBS) {
-        jobs[job_count].pid = pid;
-        strncpy(jobs[job_count].command, command, 255);
-        jobs[job_count].command[255] = '\0';
-        job_count++;
-    } else {
-        fprintf(stderr, "Job list full, cannot add more jobs.\n");
+// Rebuild a pipeline in the command arena from a cache entry. The words
+// are copied so the entry may be evicted while the command runs.
+static Pipeline *parse_cache_load(ParseEntry *e) {
+    Pipeline *pl = arena_alloc(&cmd_arena, sizeof(Pipeline));
+    Stage *stages = arena_alloc(&cmd_arena, sizeof(Stage) * e->nstages);
+    char *words = arena_alloc(&cmd_arena, e->words_size);
+    if (!pl || !stages || (e->words_size && !words)) return NULL;
+    memcpy(words, e->words, e->words_size);
+    memset(stages, 0, sizeof(Stage) * e->nstages);
+    pl->stages = stages;
+    pl->nstages = e->nstages;
+    pl->background = e->background;
+    pl->timed = e->timed;
+    pl->text = NULL;
+    pl->builtin = e->builtin;
+    pl->name_expands = e->name_expands;
+    pl->nice = e->nice;
+    pl->ioprio = e->ioprio;
+    pl->cgroup_id = 0;
+
+    const int *lp = e->layout;
+    for (int i = 0; i < e->nstages; i++) {
+        Stage *st = &stages[i];
+        int argc = *lp++;
+        st->in_file = *lp >= 0 ? words + *lp : NULL;
+        lp++;
+        st->out_file = *lp >= 0 ? words + *lp : NULL;
+        lp++;
+        st->err_file = *lp >= 0 ? words + *lp : NULL;
+        lp++;
+        st->here = *lp >= 0 ? words + *lp : NULL;
+        lp++;
+        st->argv = arena_alloc(&cmd_arena, sizeof(char *) * (argc + 1));
+        if (!st->argv) return NULL;
+        for (int w = 0; w < argc; w++) st->argv[w] = words + *lp++;
+        st->argv[argc] = NULL;
     }
+    return pl;
 }
 
-void list_jobs() {
-    for (int i = 0; i < job_count; i++) {
-        if (jobs[i].pid != 0) {
-            printf("[%d] %d %s\n", i + 1, jobs[i].pid, jobs[i].command);
+// Turn a command line into an unexpanded pipeline in the command arena,
+// from the parse cache when the same text was seen before. Returns NULL
+// for an empty line, or with *error set to the exit status on a syntax error.
+Pipeline *parse_line(const char *cmdline, int *error) {
+    heredoc_used = 0;
+    int cacheable = heredoc_count == 0;  // Here-document bodies are not part of the text
+    size_t len = strlen(cmdline);
+    unsigned hash = hash_bytes(cmdline, len);
+    for (ParseEntry *e = cacheable ? parse_cache[hash % PARSE_CACHE_BUCKETS] : NULL; e; e = e->chain) {
+        if (e->hash == hash && e->text_len == len && memcmp(e->text, cmdline, len) == 0) {
+            parse_hits++;
+            parse_lru_unlink(e);
+            parse_lru_push(e);
+            return parse_cache_load(e);
         }
     }
+    parse_misses++;
+
+    int background = 0;
+    char **arglist = tokenize((char *)cmdline, &background);
+    if (arglist == NULL) return NULL;  // Nothing to run
+    Pipeline *pl = parse_simple(arglist, background, error);
+    if (pl && cacheable) parse_cache_store(cmdline, len, hash, pl);
+    return pl;
 }
 
-void kill_job(int job_id) {
-    if (job_id < 1 || job_id > job_count || jobs[job_id - 1].pid == 0) {
-        fprintf(stderr, "kill: invalid job id %d\n", job_id);
-    } else {
-        if (kill(jobs[job_id - 1].pid, SIGKILL) == 0) {
-            printf("Killed job [%d] %d\n", job_id, jobs[job_id - 1].pid);
-            jobs[job_id - 1].pid = 0;  // Mark job as terminated
+// Read a `nice [-n adjustment]` or `ionice [-c class] [-n level]` prefix,
+// moving *args past it. Returns 0 after printing the usage.
+static int parse_priority(char ***args, int *nice, int *ioprio) {
+    char **arg = *args;
+    int is_nice = strcmp(arg[0], "nice") == 0;
+    int adjust = 10, ioclass = IOPRIO_CLASS_NONE, level = -1;
+    int ok = 1;
+    for (arg++; ok && arg[0] && arg[0][0] == '-'; arg += 2) {
+        if (!arg[1]) {
+            ok = 0;
+            break;
+        }
+        char *end;
+        long value = strtol(arg[1], &end, 10);
+        int numeric = *arg[1] != '\0' && *end == '\0';
+        if (strcmp(arg[0], "-n") == 0 && numeric && is_nice && value >= -20 && value <= 19) {
+            adjust = (int)value;
+        } else if (strcmp(arg[0], "-n") == 0 && numeric && !is_nice && value >= 0 && value <= 7) {
+            level = (int)value;
+        } else if (strcmp(arg[0], "-c") == 0 && !is_nice) {
+            for (int c = 1; ioprio_classes[c]; c++) {
+                if ((numeric && value == c) || strcmp(arg[1], ioprio_classes[c]) == 0) ioclass = c;
+            }
+            ok = ioclass != IOPRIO_CLASS_NONE;
         } else {
-            perror("kill");
+            ok = 0;
         }
     }
-}
+    if (!ok || !arg[0] || (!is_nice && ioclass == IOPRIO_CLASS_NONE && level < 0)) {
+        if (is_nice) {
+            printf("Usage: nice [-n adjustment] <command> [| command...]\n");
+        } else {
+            printf("Usage: ionice [-c 1|2|3] [-n level] <command> [| command...]\n");
+        }
+        return 0;
+    }
 
-void sigchld_handler(int signum) {
-    int status;
-    pid_t pid;
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-        for (int i = 0; i < job_count; i++) {
-            if (jobs[i].pid == pid) {
-                jobs[i].pid = 0;  // Mark as terminated
-                break;
-            }
+    if (is_nice) {
+        *nice = adjust;
+    } else {
+        if (ioclass == IOPRIO_CLASS_NONE) ioclass = IOPRIO_CLASS_BE;  // -n alone
+        if (ioclass == IOPRIO_CLASS_IDLE) {
+            level = 0;  // The idle class has no levels
+        } else if (level < 0) {
+            level = 4;  // The kernel's default level
         }
+        *ioprio = ioclass << IOPRIO_CLASS_SHIFT | level;
     }
+    *args = arg;
+    return 1;
 }
 
-char **tokenize(char *cmdline, int *background) {
-    char **arglist = (char **)malloc(sizeof(char *) * (MAXARGS + 1));
-    if (!arglist) {
-        perror("malloc() failed for arglist");
-        return NULL;
+// Build the pipeline of one simple command: its time, nice and ionice
+// prefixes, stages and redirections, and its built-in when the name is a
+// literal word
+static Pipeline *parse_simple(char **arglist, int background, int *error) {
+    // `time [-j]` prefix: report resource usage once the command ends
+    int timed = TIME_OFF;
+    if (strcmp(arglist[0], "time") == 0) {
+        timed = TIME_TEXT;
+        arglist++;
+        if (arglist[0] && strcmp(arglist[0], "-j") == 0) {
+            timed = TIME_JSON;
+            arglist++;
+        }
+        if (arglist[0] == NULL) {
+            printf("Usage: time [-j] <command> [| command...]\n");
+            *error = 2;
+            return NULL;
+        }
     }
 
-    for (int j = 0; j < MAXARGS + 1; j++) {
-        arglist[j] = (char *)malloc(sizeof(char) * ARGLEN);
-        if (!arglist[j]) {
-            perror("malloc() failed for arglist element");
+    // `nice` and `ionice` prefixes: set in each child before it execs
+    int nice = 0, ioprio = 0;
+    while (strcmp(arglist[0], "nice") == 0 || strcmp(arglist[0], "ionice") == 0) {
+        if (!parse_priority(&arglist, &nice, &ioprio)) {
+            *error = 2;
             return NULL;
         }
-        bzero(arglist[j], ARGLEN);
     }
 
-    int argnum = 0;
-    char *cp = cmdline;
-    char *start;
-    int len;
-
-    while (*cp != '\0') {
-        while (*cp == ' ' || *cp == '\t') cp++;
-        start = cp;
-        len = 1;
-        while (*++cp != '\0' && *cp != ' ' && *cp != '\t') len++;
-        strncpy(arglist[argnum], start, len);
-        arglist[argnum][len] = '\0';
-        argnum++;
+    Pipeline *pl = parse_pipeline(arglist, background);
+    if (!pl) {
+        *error = 2;  // Syntax error: exit status 2
+        return NULL;
     }
+    pl->timed = timed;
+    pl->nice = nice;
+    pl->ioprio = ioprio;
+    const char *name = pl->stages[0].argv[0];
+    pl->name_expands = name && strchr(name, '$') != NULL;
+    pl->builtin = name && !pl->name_expands ? find_builtin(name) : NULL;
+    return pl;
+}
 
-    if (argnum > 0 && strcmp(arglist[argnum - 1], "&") == 0) {
-        *background = 1;
-        free(arglist[argnum - 1]);
-        arglist[argnum - 1] = NULL;
+static double timeval_s(const struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static double elapsed_s(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+// Add the counters of one stage to a pipeline total (max RSS is the peak)
+static void add_usage(struct rusage *total, const struct rusage *ru) {
+    timeradd(&total->ru_utime, &ru->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &ru->ru_stime, &total->ru_stime);
+    if (ru->ru_maxrss > total->ru_maxrss) total->ru_maxrss = ru->ru_maxrss;
+    total->ru_minflt += ru->ru_minflt;
+    total->ru_majflt += ru->ru_majflt;
+    total->ru_nvcsw += ru->ru_nvcsw;
+    total->ru_nivcsw += ru->ru_nivcsw;
+}
+
+static void print_json_string(FILE *fp, const char *str) {
+    fputc('"', fp);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            fprintf(fp, "\\%c", *str);
+        } else if ((unsigned char)*str < 0x20) {
+            fprintf(fp, "\\u%04x", *str);
+        } else {
+            fputc(*str, fp);
+        }
     }
-    arglist[argnum] = NULL;
-    return arglist;
+    fputc('"', fp);
 }
 
-void handle_pipes_and_execute(char **arglist, int background) {
-    int input_fd = -1, output_fd = -1, error_fd = -1;
-    int pipefd[2];
+// One line (or JSON object) of a `time` report. A max RSS of 0 was not
+// measured and shows as `-` (null in JSON).
+static void print_usage(int timed, const char *name, int code, double real, const struct rusage *ru) {
+    char maxrss[24];
+    snprintf(maxrss, sizeof(maxrss), "%s", timed == TIME_JSON ? "null" : "-");
+    if (ru->ru_maxrss > 0) snprintf(maxrss, sizeof(maxrss), "%ld", ru->ru_maxrss);
+    if (timed == TIME_JSON) {
+        fprintf(stderr, "{\"command\": ");
+        print_json_string(stderr, name);
+        fprintf(stderr, ", \"status\": %d, \"real\": %.6f, \"user\": %.6f, \"sys\": %.6f, "
+                "\"maxrss_kb\": %s, \"minflt\": %ld, \"majflt\": %ld, \"nvcsw\": %ld, \"nivcsw\": %ld}",
+                code, real, timeval_s(&ru->ru_utime), timeval_s(&ru->ru_stime), maxrss,
+                ru->ru_minflt, ru->ru_majflt, ru->ru_nvcsw, ru->ru_nivcsw);
+    } else {
+        fprintf(stderr, "%9.3f %9.3f %9.3f %9s %8ld %6ld %7ld %7ld  %3d  %s\n",
+                real, timeval_s(&ru->ru_utime), timeval_s(&ru->ru_stime), maxrss,
+                ru->ru_minflt, ru->ru_majflt, ru->ru_nvcsw, ru->ru_nivcsw, code, name);
+    }
+}
 
-    for (int i = 0; arglist[i] != NULL; i++) {
-        if (strcmp(arglist[i], "<") == 0) {
-            input_fd = open(arglist[i + 1], O_RDONLY);
-            if (input_fd < 0) {
-                perror("Failed to open input file");
-                return;
-            }
-            free(arglist[i]);
-            arglist[i] = NULL;
-        } else if (strcmp(arglist[i], ">") == 0) {
-            output_fd = open(arglist[i + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (output_fd < 0) {
-                perror("Failed to open output file");
-                return;
-            }
-            free(arglist[i]);
-            arglist[i] = NULL;
-        } else if (strcmp(arglist[i], "2>") == 0) {
-            error_fd = open(arglist[i + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (error_fd < 0) {
-                perror("Failed to open error file");
-                return;
-            }
-            free(arglist[i]);
-            arglist[i] = NULL;
-        } else if (strcmp(arglist[i], "|") == 0) {
-            if (pipe(pipefd) == -1) {
-                perror("pipe() failed");
-                return;
-            }
+static void print_usage_header(int timed) {
+    if (timed == TIME_TEXT) {
+        fprintf(stderr, "%9s %9s %9s %9s %8s %6s %7s %7s  %3s  %s\n", "real", "user", "sys",
+                "maxrss_kb", "minflt", "majflt", "nvcsw", "nivcsw", "st", "command");
+    }
+}
 
-            arglist[i] = NULL;
-            execute(arglist, input_fd, pipefd[1], error_fd, 0);
+// Print what each stage of a finished pipeline used, then the total
+// (wall time from the first start to the last exit, summed counters)
+void report_times(Pipeline *pl) {
+    struct rusage total;
+    memset(&total, 0, sizeof(total));
+    struct timespec first = pl->stages[0].start, end = pl->stages[0].end;
 
-            close(pipefd[1]);
-            input_fd = pipefd[0];
-            arglist = &arglist[i + 1];
-            i = -1;
+    print_usage_header(pl->timed);
+    if (pl->timed == TIME_JSON) fprintf(stderr, "{\"stages\": [");
+    for (int i = 0; i < pl->nstages; i++) {
+        Stage *st = &pl->stages[i];
+        if (elapsed_s(&end, &st->end) > 0) end = st->end;
+        if (!st->pid) memset(&st->usage, 0, sizeof(st->usage));  // Never started
+        add_usage(&total, &st->usage);
+        if (pl->timed == TIME_JSON && i > 0) fprintf(stderr, ", ");
+        if (pl->timed == TIME_JSON || pl->nstages > 1) {
+            print_usage(pl->timed, st->argv[0], stage_ran(st) ? exit_code(st->status) : 127,
+                        elapsed_s(&st->start, &st->end), &st->usage);
         }
     }
+    Stage *last = &pl->stages[pl->nstages - 1];
+    if (pl->timed == TIME_JSON) fprintf(stderr, "], \"total\": ");
+    print_usage(pl->timed, pl->text, stage_ran(last) ? exit_code(last->status) : 127, elapsed_s(&first, &end), &total);
+    if (pl->timed == TIME_JSON) fprintf(stderr, "}\n");
+}
 
-    execute(arglist, input_fd, output_fd, error_fd, background);
+// Time a built-in command: it runs in the shell, so its usage is the
+// shell's own growth in getrusage(RUSAGE_SELF) while it ran
+int time_builtin(Builtin *builtin, Stage *st, int timed, const char *text) {
+    struct rusage before, after;
+    struct timespec start, end;
+    getrusage(RUSAGE_SELF, &before);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    last_status = run_builtin_stage(builtin, st);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &after);
+    fflush(stdout);
 
-    if (input_fd != -1) close(input_fd);
-    if (output_fd != -1) close(output_fd);
-    if (error_fd != -1) close(error_fd);
+    timersub(&after.ru_utime, &before.ru_utime, &after.ru_utime);
+    timersub(&after.ru_stime, &before.ru_stime, &after.ru_stime);
+    after.ru_minflt -= before.ru_minflt;
+    after.ru_majflt -= before.ru_majflt;
+    after.ru_nvcsw -= before.ru_nvcsw;
+    after.ru_nivcsw -= before.ru_nivcsw;
+    after.ru_maxrss = 0;  // The shell's lifetime peak, not the built-in's
+    print_usage_header(timed);
+    if (timed == TIME_JSON) fprintf(stderr, "{\"stages\": [], \"total\": ");
+    print_usage(timed, text, last_status, elapsed_s(&start, &end), &after);
+    if (timed == TIME_JSON) fprintf(stderr, "}\n");
+    return last_status;
 }
 
 int are_jobs_present() {
-    // Check if there are any active jobs
-    for (int i = 0; i < job_count; i++) {
-        if (jobs[i].pid != 0) {
-            return 1; // Job is present
-        }
-    }
-    return 0; // No jobs present
+    return job_count > 0;  // Only live jobs are counted
 }
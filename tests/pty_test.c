@@ -0,0 +1,125 @@
+// Interactive regression tests for myShellv6
+//
+// Build:  make tests/pty_test
+// Run:    tests/pty_test ./myShellv6     (or `make test`)
+//
+// Each case starts the shell on a pseudo-terminal in a scratch directory,
+// types its input one chunk at a time, waiting for the shell to go quiet
+// after each, and then looks for the expected text in everything the
+// terminal showed. A case that hangs simply never prints it.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <pty.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define QUIET_MS 300
+#define CHUNK_TIMEOUT_S 5
+#define OUTPUT_MAX 65536
+
+typedef struct {
+    const char *name;
+    const char *input[8];   // Typed in order; NULL ends the list
+    const char *expect;     // Must appear in the output
+} Case;
+
+Case cases[] = {
+    // The in-shell `read` must not keep the terminal from `cat`
+    {"read at the end of a pipeline", {"cat | read X\r", "hello\r", "\004", "echo got $X\r"}, "got hello"},
+    // Here-documents and here-strings with the word attached to the operator
+    {"attached here-document", {"tr a-z A-Z <<EOF\r", "body\r", "EOF\r"}, "BODY"},
+    {"attached here-string", {"tr a-z A-Z <<<word\r"}, "WORD"},
+};
+#define NUM_CASES (int)(sizeof(cases) / sizeof(cases[0]))
+
+char scratch_dir[] = "/tmp/pty_test.XXXXXX";
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Append output to buf until nothing arrives for QUIET_MS
+static void drain(int fd, char *buf, size_t *len) {
+    double deadline = now_s() + CHUNK_TIMEOUT_S;
+    while (now_s() < deadline) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, QUIET_MS) <= 0) break;
+        char tmp[4096];
+        ssize_t n = read(fd, tmp, sizeof(tmp));
+        if (n <= 0) break;
+        size_t room = OUTPUT_MAX - 1 - *len;
+        if ((size_t)n > room) n = room;
+        memcpy(buf + *len, tmp, n);
+        *len += n;
+    }
+    buf[*len] = '\0';
+}
+
+static int run_case(const char *shell, Case *c) {
+    int fd;
+    pid_t pid = forkpty(&fd, NULL, NULL, NULL);
+    if (pid == 0) {
+        if (chdir(scratch_dir) != 0) _exit(126);
+        execl(shell, shell, (char *)NULL);
+        _exit(127);
+    }
+    if (pid < 0) {
+        perror("forkpty");
+        return 0;
+    }
+
+    static char output[OUTPUT_MAX];
+    size_t len = 0;
+    drain(fd, output, &len);
+    size_t start = len;  // Skip the banner and first prompt
+    for (int i = 0; i < 8 && c->input[i]; i++) {
+        if (write(fd, c->input[i], strlen(c->input[i])) < 0) break;
+        drain(fd, output, &len);
+    }
+    int ok = strstr(output + start, c->expect) != NULL;
+
+    kill(pid, SIGKILL);  // Leftover stages see the terminal go away
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {
+    }
+    close(fd);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s shell\n", argv[0]);
+        return 2;
+    }
+    char shell[PATH_MAX];
+    if (!realpath(argv[1], shell)) {
+        perror(argv[1]);
+        return 2;
+    }
+    if (!mkdtemp(scratch_dir)) {
+        perror("mkdtemp");
+        return 2;
+    }
+
+    int failed = 0;
+    for (int i = 0; i < NUM_CASES; i++) {
+        int ok = run_case(shell, &cases[i]);
+        printf("%s: %s\n", ok ? "ok" : "FAIL", cases[i].name);
+        failed += !ok;
+    }
+
+    char cmd[PATH_MAX + 16];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", scratch_dir);
+    if (system(cmd) != 0) fprintf(stderr, "could not remove %s\n", scratch_dir);
+    printf("%d of %d passed\n", NUM_CASES - failed, NUM_CASES);
+    return failed ? 1 : 0;
+}